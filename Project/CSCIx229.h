@@ -28,9 +28,26 @@ extern "C" {
 void Print(const char* format , ...);
 void Fatal(const char* format , ...);
 unsigned int LoadTexBMP(const char* file);
+unsigned int LoadTexBMPMip(const char* file);
+unsigned char* ReadBMP(const char* file,unsigned int* dx,unsigned int* dy);
+unsigned char* ReadBMPMip(const char* file,unsigned int* dx,unsigned int* dy,int* levels);
+void TexImageBMP(const char* file,unsigned int dx,unsigned int dy,int levels,const unsigned char* image);
+unsigned int LoadTexBMPAsync(const char* file,int mip);
+int  UploadTextures(int budget);
+void FinishTextures(void);
+void SaveClip(const char* file,const char* path,unsigned int count,double fps);
+int  OpenVideo(const char* file,double fps);
+int  UpdateVideo(int vid,double t);
+void CloseVideo(int vid);
+void SyncVideo(int wait);
+unsigned int VideoTexture(int vid);
 void Project();
 void ErrCheck(const char* where);
 int  LoadOBJ(const char* file);
+void DrawOBJ(int obj);
+void* MapFile(const char* file,size_t* size);
+void UnmapFile(void* data,size_t size);
+int  FileStamp(const char* file,long long* size,long long* mtime);
 
 #ifdef __cplusplus
 }
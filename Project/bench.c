@@ -0,0 +1,203 @@
+/*
+ *  Headless replay benchmark for final.c
+ *
+ *  Usage: bench <capture> [width height] [fps]
+ *
+ *  Renders the scene offscreen through EGL (Mesa's software renderer works
+ *  without a display or GPU) with the camera driven by an eye capture.  The
+ *  simulation clock advances exactly 1/fps per frame, so a capture always
+ *  produces the same frames.  Per frame CPU time, percentiles and total wall
+ *  time are written to stdout as JSON.
+ *
+ *  final.c is built with -DBENCH, which leaves out its GLUT main.  The few
+ *  GLUT calls display() makes are answered here: the elapsed time is the
+ *  simulation clock, menus are ignored and text is not drawn.
+ */
+#include "CSCIx229.h"
+#include "eyecap.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <time.h>
+
+//  Scene in final.c
+extern double Ex,Ey,Ez,Ox,Oy,Oz,Ux,Uy,Uz;
+void init_scene(void);
+void display(void);
+void reshape(int width,int height);
+void timer(int toggle);
+
+//  Simulation clock in seconds
+static double simTime=0;
+
+/*
+ *  GLUT stand-ins
+ */
+void* glutBitmapHelvetica18;
+int  glutGet(GLenum query) {return query==GLUT_ELAPSED_TIME ? (int)(1000*simTime+0.5) : 0;}
+void glutSwapBuffers(void) {}
+void glutPostRedisplay(void) {}
+void glutTimerFunc(unsigned int ms,void (*func)(int),int value) {}
+void glutBitmapCharacter(void* font,int ch) {}
+int  glutCreateMenu(void (*func)(int)) {return 1;}
+void glutSetMenu(int menu) {}
+void glutAddMenuEntry(const char* label,int value) {}
+void glutAddSubMenu(const char* label,int menu) {}
+void glutChangeToMenuEntry(int item,const char* label,int value) {}
+void glutRemoveMenuItem(int item) {}
+void glutAttachMenu(int button) {}
+
+/*
+ *  Offscreen OpenGL context
+ */
+static void OpenContext(int width,int height)
+{
+   EGLDisplay dpy;
+   EGLConfig  cfg;
+   EGLContext ctx;
+   EGLSurface srf;
+   EGLint     n;
+   const EGLint attr[] = {EGL_SURFACE_TYPE,EGL_PBUFFER_BIT,EGL_RENDERABLE_TYPE,EGL_OPENGL_BIT,
+                          EGL_RED_SIZE,8,EGL_GREEN_SIZE,8,EGL_BLUE_SIZE,8,EGL_DEPTH_SIZE,24,EGL_NONE};
+   const EGLint size[] = {EGL_WIDTH,width,EGL_HEIGHT,height,EGL_NONE};
+   //  Prefer a display that needs no window system
+   PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+   dpy = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,EGL_DEFAULT_DISPLAY,NULL) : EGL_NO_DISPLAY;
+   if (dpy==EGL_NO_DISPLAY) dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+   if (dpy==EGL_NO_DISPLAY || !eglInitialize(dpy,NULL,NULL)) Fatal("Cannot open EGL display\n");
+   if (!eglChooseConfig(dpy,attr,&cfg,1,&n) || n<1) Fatal("No EGL configuration for OpenGL pbuffers\n");
+   if (!eglBindAPI(EGL_OPENGL_API)) Fatal("EGL does not support OpenGL\n");
+   ctx = eglCreateContext(dpy,cfg,EGL_NO_CONTEXT,NULL);
+   srf = eglCreatePbufferSurface(dpy,cfg,size);
+   if (ctx==EGL_NO_CONTEXT || srf==EGL_NO_SURFACE || !eglMakeCurrent(dpy,srf,srf,ctx))
+      Fatal("Cannot create %dx%d EGL pbuffer\n",width,height);
+}
+
+/*
+ *  Seconds on a clock
+ */
+static double Clock(clockid_t id)
+{
+   struct timespec t;
+   clock_gettime(id,&t);
+   return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+/*
+ *  Sort doubles
+ */
+static int CompareDouble(const void* a,const void* b)
+{
+   double x = *(const double*)a;
+   double y = *(const double*)b;
+   return (x>y) - (x<y);
+}
+
+/*
+ *  Percentile of sorted values
+ */
+static double Percentile(const double* v,int n,double p)
+{
+   int k = (int)(p/100*(n-1)+0.5);
+   return v[k];
+}
+
+/*
+ *  Print a JSON string with quotes, backslashes and control characters escaped
+ */
+static void PrintString(const char* str)
+{
+   putchar('"');
+   for (;*str;str++)
+   {
+      unsigned char ch = *str;
+      if (ch=='"' || ch=='\\')
+         printf("\\%c",ch);
+      else if (ch<0x20)
+         printf("\\u%04x",ch);
+      else
+         putchar(ch);
+   }
+   putchar('"');
+}
+
+int main(int argc,char* argv[])
+{
+   int        k,frames;
+   int        width=1000,height=1000;
+   double     fps=60,tick=0,wall,sum=0;
+   double*    cpu;
+   double*    sorted;
+   EyeCapFile cap;
+   EyeCap     eye;
+
+   if (argc!=2 && argc!=4 && argc!=5) Fatal("Usage: bench <capture> [width height] [fps]\n");
+   if (argc>=4)
+   {
+      width = atoi(argv[2]);
+      height = atoi(argv[3]);
+   }
+   if (argc==5) fps = atof(argv[4]);
+   if (width<1 || height<1 || fps<=0) Fatal("Invalid size %dx%d or rate %g\n",width,height,fps);
+   if (MapEyeCapture(argv[1],&cap) || cap.n<=0) Fatal("Cannot read eye capture %s\n",argv[1]);
+
+   //  Scene with every texture in place before timing starts
+   //  and every video frame shown when it is due
+   OpenContext(width,height);
+   init_scene();
+   FinishTextures();
+   SyncVideo(1);
+   reshape(width,height);
+
+   //  One frame per 1/fps of the capture
+   frames = (int)floor(cap.end*fps)+1;
+   cpu = (double*)malloc(2*frames*sizeof(double));
+   if (!cpu) Fatal("Cannot allocate memory for %d frames\n",frames);
+   sorted = cpu+frames;
+
+   wall = Clock(CLOCK_MONOTONIC);
+   for (k=0;k<frames;k++)
+   {
+      double t0;
+      simTime = k/fps;
+      //  The light moves on the same 50 ms timer as the game
+      while (tick<=simTime)
+      {
+         timer(0);
+         tick += 0.05;
+      }
+      //  Camera from the capture
+      SampleEyeCapture(&cap,simTime,&eye);
+      Ex = eye.Ex; Ey = eye.Ey; Ez = eye.Ez;
+      Ox = eye.Ox; Oy = eye.Oy; Oz = eye.Oz;
+      Ux = eye.Ux; Uy = eye.Uy; Uz = eye.Uz;
+      //  Time the frame through to the last pixel
+      t0 = Clock(CLOCK_PROCESS_CPUTIME_ID);
+      display();
+      glFinish();
+      cpu[k] = 1000*(Clock(CLOCK_PROCESS_CPUTIME_ID)-t0);
+      sum += cpu[k];
+   }
+   wall = Clock(CLOCK_MONOTONIC)-wall;
+   ErrCheck("bench");
+   UnmapEyeCapture(&cap);
+
+   //  Report
+   memcpy(sorted,cpu,frames*sizeof(double));
+   qsort(sorted,frames,sizeof(double),CompareDouble);
+   printf("{\n");
+   printf("  \"capture\": ");
+   PrintString(argv[1]);
+   printf(",\n");
+   printf("  \"width\": %d,\n  \"height\": %d,\n  \"fps\": %g,\n",width,height,fps);
+   printf("  \"frames\": %d,\n",frames);
+   printf("  \"wall_s\": %.6f,\n",wall);
+   printf("  \"cpu_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n",
+          sum/frames,Percentile(sorted,frames,50),Percentile(sorted,frames,90),Percentile(sorted,frames,99),sorted[frames-1]);
+   printf("  \"frame_cpu_ms\": [");
+   for (k=0;k<frames;k++)
+      printf("%s%.4f",k ? ", " : "",cpu[k]);
+   printf("]\n}\n");
+   free(cpu);
+   return 0;
+}
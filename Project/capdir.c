@@ -0,0 +1,688 @@
+/*
+ *  Watch the capture directory
+ *
+ *  Keeps an index of the capture files sorted by name, with the size,
+ *  duration and path bounds of each.  On Linux inotify reports files as
+ *  they are added, removed or finished, so keeping the index current costs
+ *  only the changes.  Elsewhere, or when the directory cannot be watched,
+ *  it is rescanned every few seconds and compared with the index.  Each
+ *  change is passed to a callback so the caller can update its own view of
+ *  the files incrementally.
+ *
+ *  The captures are also kept newest first and grouped by day.  A change
+ *  moves only its own capture in that order and adjusts only its own day.
+ *
+ *  The summaries are saved in .index in the directory, so a capture is
+ *  only read again when its size or modification time changes.
+ */
+#include "CSCIx229.h"
+#include "eyecap.h"
+#include "capdir.h"
+#include <dirent.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+//  Seconds between rescans without inotify
+#define RESCAN_INTERVAL 2
+
+//  Saved index
+//    Fixed size records in name order followed by the names
+#define INDEX_FILE    ".index"
+#define INDEX_VERSION 1
+typedef struct
+{
+   char magic[4];         //  Always ECIX
+   int  version;          //  Index format version
+   int  count;            //  Number of captures
+   int  ns;               //  Size of the string table
+} index_t;
+typedef struct
+{
+   long long size,mtime;  //  Size and modification time of the capture
+   double duration;       //  Seconds of capture
+   double lo[3],hi[3];    //  Bounding box of the eye path
+   int    name;           //  String table offset of the file name
+   int    pad;            //  Keep records a multiple of 8 bytes
+} irec_t;
+
+static char*      dirpath=NULL;   //  Directory watched
+static CapEntry** entry=NULL;     //  Entries sorted by name
+static int        Nentry=0,Mentry=0;
+static CapEntry** byId=NULL;      //  Entries by id (NULL once removed)
+static int        Nid=0,Mid=0;
+static CapEntry** newest=NULL;    //  Entries newest first
+static CapDay*    day=NULL;       //  Days in that order
+static int        Nday=0;
+static int        dirty=0;        //  Saved index is out of date
+static void*      imap=NULL;      //  Saved index while the directory is first read
+static size_t     ilen=0;
+static time_t     scanned=0;      //  Time of the last scan
+#ifdef __linux__
+static int        watch=-1;       //  inotify descriptor
+#endif
+
+/*
+ *  Files that are captures (not hidden like . and .. and the index, or a
+ *  capture being compacted)
+ */
+static int IsCapture(const char* name)
+{
+   size_t len = strlen(name);
+   if (name[0]=='.') return 0;
+   return len<4 || strcmp(name+len-4,".tmp");
+}
+
+/*
+ *  Path of a file in the directory
+ */
+static char* Path(const char* name)
+{
+   char* path = (char*)malloc(strlen(dirpath)+strlen(name)+2);
+   if (!path) Fatal("Cannot allocate memory for capture %s\n",name);
+   sprintf(path,"%s/%s",dirpath,name);
+   return path;
+}
+
+/*
+ *  Map the saved index
+ *    Anything that does not check out is ignored
+ */
+static void ReadIndex(void)
+{
+   int k;
+   index_t* h;
+   irec_t*  r;
+   char*    path = Path(INDEX_FILE);
+   imap = MapFile(path,&ilen);
+   free(path);
+   if (!imap) return;
+   h = (index_t*)imap;
+   r = (irec_t*)(h+1);
+   if (ilen<sizeof(index_t) || memcmp(h->magic,"ECIX",4) || h->version!=INDEX_VERSION ||
+       h->count<0 || h->ns<1 || ilen!=sizeof(index_t)+h->count*sizeof(irec_t)+h->ns ||
+       ((char*)imap)[ilen-1])
+   {
+      UnmapFile(imap,ilen);
+      imap = NULL;
+      return;
+   }
+   for (k=0;k<h->count;k++)
+      if (r[k].name<0 || r[k].name>=h->ns)
+      {
+         UnmapFile(imap,ilen);
+         imap = NULL;
+         return;
+      }
+}
+
+/*
+ *  Saved summary of a capture if it has the given size and time
+ */
+static const irec_t* FindIndex(const char* name,long long size,long long mtime)
+{
+   index_t* h = (index_t*)imap;
+   irec_t*  r;
+   char*    str;
+   int      lo=0,hi;
+   if (!imap) return NULL;
+   r = (irec_t*)(h+1);
+   str = (char*)(r+h->count);
+   hi = h->count;
+   while (lo<hi)
+   {
+      int mid = (lo+hi)/2;
+      int cmp = strcmp(str+r[mid].name,name);
+      if (cmp==0) return (r[mid].size==size && r[mid].mtime==mtime) ? r+mid : NULL;
+      if (cmp<0)
+         lo = mid+1;
+      else
+         hi = mid;
+   }
+   return NULL;
+}
+
+/*
+ *  Save the index
+ *    Failure only costs reading the captures again next time
+ */
+static void WriteIndex(void)
+{
+   int     k;
+   index_t h;
+   char*   path;
+   char*   tmp;
+   FILE*   f;
+
+   if (!dirpath || !dirty) return;
+   dirty = 0;
+   //  Header
+   memset(&h,0,sizeof(h));
+   memcpy(h.magic,"ECIX",4);
+   h.version = INDEX_VERSION;
+   h.count = Nentry;
+   h.ns = 1;
+   for (k=0;k<Nentry;k++)
+      h.ns += strlen(entry[k]->name)+1;
+
+   //  Write to a temporary file and rename so a partial index is never seen
+   path = Path(INDEX_FILE);
+   tmp = Path(INDEX_FILE ".tmp");
+   f = fopen(tmp,"wb");
+   if (!f)
+   {
+      fprintf(stderr,"Cannot write capture index %s\n",path);
+      free(path);
+      free(tmp);
+      return;
+   }
+   fwrite(&h,sizeof(h),1,f);
+   //  Records refer to the string table by offset
+   for (k=0,h.ns=1;k<Nentry;k++)
+   {
+      irec_t r;
+      memset(&r,0,sizeof(r));
+      r.size = entry[k]->size;
+      r.mtime = entry[k]->mtime;
+      r.duration = entry[k]->duration;
+      memcpy(r.lo,entry[k]->lo,sizeof(r.lo));
+      memcpy(r.hi,entry[k]->hi,sizeof(r.hi));
+      r.name = h.ns;
+      h.ns += strlen(entry[k]->name)+1;
+      fwrite(&r,sizeof(r),1,f);
+   }
+   //  Offset 0 is an empty string
+   fputc(0,f);
+   for (k=0;k<Nentry;k++)
+      fwrite(entry[k]->name,strlen(entry[k]->name)+1,1,f);
+   k = ferror(f);
+   if (fclose(f) || k || rename(tmp,path))
+   {
+      fprintf(stderr,"Cannot write capture index %s\n",path);
+      remove(tmp);
+   }
+   free(path);
+   free(tmp);
+}
+
+/*
+ *  Position of name in the index, or where it would go
+ */
+static int Search(const char* name,int* found)
+{
+   int lo=0,hi=Nentry;
+   while (lo<hi)
+   {
+      int mid = (lo+hi)/2;
+      int cmp = strcmp(entry[mid]->name,name);
+      if (cmp==0)
+      {
+         *found = 1;
+         return mid;
+      }
+      if (cmp<0)
+         lo = mid+1;
+      else
+         hi = mid;
+   }
+   *found = 0;
+   return lo;
+}
+
+/*
+ *  Order of entries newest first, then by name
+ */
+static int CompareNewest(const CapEntry* x,const CapEntry* y)
+{
+   if (x->mtime!=y->mtime) return (x->mtime<y->mtime) - (x->mtime>y->mtime);
+   return strcmp(x->name,y->name);
+}
+
+/*
+ *  Local date of a file time as yyyymmdd
+ */
+static int Date(long long mtime)
+{
+   time_t t = (time_t)mtime;
+   struct tm* tm = localtime(&t);
+   return tm ? 10000*(tm->tm_year+1900)+100*(tm->tm_mon+1)+tm->tm_mday : 0;
+}
+
+/*
+ *  Position of an entry among the first n in date order, or where it would go
+ */
+static int SearchNewest(const CapEntry* e,int n)
+{
+   int lo=0,hi=n;
+   while (lo<hi)
+   {
+      int mid = (lo+hi)/2;
+      if (CompareNewest(newest[mid],e)<0)
+         lo = mid+1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
+
+/*
+ *  Day holding position k in date order (the last day starting at or before k)
+ */
+static int SearchDay(int k)
+{
+   int lo=0,hi=Nday;
+   while (lo<hi)
+   {
+      int mid = (lo+hi)/2;
+      if (day[mid].first<=k)
+         lo = mid+1;
+      else
+         hi = mid;
+   }
+   return lo-1;
+}
+
+/*
+ *  Move the days after d by n places in date order
+ */
+static void ShiftDays(int d,int n)
+{
+   for (d++;d<Nday;d++)
+      day[d].first += n;
+}
+
+/*
+ *  Put an entry among the first n in date order and count it in its day
+ *    Days are contiguous in date order so the entry joins the day of the
+ *    entry before or after it, or starts a day of its own between them
+ */
+static void Link(CapEntry* e,int n)
+{
+   int d,k = SearchNewest(e,n);
+   int date = Date(e->mtime);
+   memmove(newest+k+1,newest+k,(n-k)*sizeof(CapEntry*));
+   newest[k] = e;
+   d = SearchDay(k-1);
+   if (k>0 && day[d].date==date)
+      day[d].count++;
+   else
+   {
+      d++;
+      if (d<Nday && day[d].date==date)
+      {
+         day[d].first = k;
+         day[d].count++;
+      }
+      else
+      {
+         memmove(day+d+1,day+d,(Nday-d)*sizeof(CapDay));
+         day[d].date = date;
+         day[d].first = k;
+         day[d].count = 1;
+         Nday++;
+      }
+   }
+   ShiftDays(d,+1);
+}
+
+/*
+ *  Take entry k out of the first n in date order and its day
+ */
+static void Unlink(int k,int n)
+{
+   int d = SearchDay(k);
+   memmove(newest+k,newest+k+1,(n-k-1)*sizeof(CapEntry*));
+   ShiftDays(d,-1);
+   if (--day[d].count==0)
+   {
+      memmove(day+d,day+d+1,(Nday-d-1)*sizeof(CapDay));
+      Nday--;
+   }
+}
+
+/*
+ *  Read size, time, duration and bounds of an entry
+ *    Returns 0 if the file is unchanged
+ */
+static int Stat(CapEntry* e)
+{
+   int k;
+   long long size,mtime;
+   const irec_t* r;
+   char* path = Path(e->name);
+   if (FileStamp(path,&size,&mtime)) size = mtime = -1;
+   if (size==e->size && mtime==e->mtime)
+   {
+      free(path);
+      return 0;
+   }
+   e->size = size;
+   e->mtime = mtime;
+   //  Saved summary
+   r = FindIndex(e->name,size,mtime);
+   if (r)
+   {
+      e->duration = r->duration;
+      memcpy(e->lo,r->lo,sizeof(e->lo));
+      memcpy(e->hi,r->hi,sizeof(e->hi));
+      free(path);
+      return 1;
+   }
+   //  Duration is the time of the last record and the bounds cover every eye position
+   e->duration = 0;
+   for (k=0;k<3;k++)
+      e->lo[k] = e->hi[k] = 0;
+   if (size>0)
+   {
+      EyeCapFile cap;
+      if (!MapEyeCapture(path,&cap))
+      {
+         long long i;
+         EyeCap eye;
+         e->duration = cap.end;
+         for (i=0;i<cap.n && !GetEyeCapture(&cap,i,&eye);i++)
+         {
+            double E[3] = {eye.Ex,eye.Ey,eye.Ez};
+            for (k=0;k<3;k++)
+            {
+               if (i==0 || E[k]<e->lo[k]) e->lo[k] = E[k];
+               if (i==0 || E[k]>e->hi[k]) e->hi[k] = E[k];
+            }
+         }
+         UnmapEyeCapture(&cap);
+      }
+   }
+   dirty = 1;
+   free(path);
+   return 1;
+}
+
+/*
+ *  Stat an entry already in the index and keep its place in date order
+ *    Returns 0 if the file is unchanged
+ */
+static int Restat(CapEntry* e)
+{
+   //  Found before the time changes, and only a new time moves it
+   int k = SearchNewest(e,Nentry);
+   long long mtime = e->mtime;
+   if (!Stat(e)) return 0;
+   if (e->mtime!=mtime)
+   {
+      Unlink(k,Nentry);
+      Link(e,Nentry-1);
+   }
+   return 1;
+}
+
+/*
+ *  Add a file to the index or refresh it if it is there already
+ */
+static void Add(const char* name,CapChanged changed)
+{
+   int found,k = Search(name,&found);
+   CapEntry* e;
+   if (found)
+   {
+      if (Restat(entry[k]) && changed) changed(entry[k],CAP_UPDATED);
+      return;
+   }
+   //  New entry with the next id
+   e = (CapEntry*)malloc(sizeof(CapEntry));
+   if (e) e->name = strdup(name);
+   if (!e || !e->name) Fatal("Cannot allocate memory for capture %s\n",name);
+   e->size = e->mtime = -2;
+   e->id = Nid;
+   if (Nentry==Mentry)
+   {
+      Mentry = Mentry ? 2*Mentry : 64;
+      entry = (CapEntry**)realloc(entry,Mentry*sizeof(CapEntry*));
+      newest = (CapEntry**)realloc(newest,Mentry*sizeof(CapEntry*));
+      day = (CapDay*)realloc(day,Mentry*sizeof(CapDay));
+      if (!entry || !newest || !day) Fatal("Cannot allocate memory for capture index\n");
+   }
+   if (Nid==Mid)
+   {
+      Mid = Mid ? 2*Mid : 64;
+      byId = (CapEntry**)realloc(byId,Mid*sizeof(CapEntry*));
+      if (!byId) Fatal("Cannot allocate memory for capture index\n");
+   }
+   Stat(e);
+   Link(e,Nentry);
+   memmove(entry+k+1,entry+k,(Nentry-k)*sizeof(CapEntry*));
+   entry[k] = e;
+   Nentry++;
+   byId[Nid++] = e;
+   dirty = 1;
+   if (changed) changed(e,CAP_ADDED);
+}
+
+/*
+ *  Remove entry k from the index
+ */
+static void Remove(int k,CapChanged changed)
+{
+   CapEntry* e = entry[k];
+   if (changed) changed(e,CAP_REMOVED);
+   Unlink(SearchNewest(e,Nentry),Nentry);
+   memmove(entry+k,entry+k+1,(Nentry-k-1)*sizeof(CapEntry*));
+   Nentry--;
+   byId[e->id] = NULL;
+   free(e->name);
+   free(e);
+   dirty = 1;
+}
+
+/*
+ *  Sort names
+ */
+static int CompareName(const void* a,const void* b)
+{
+   return strcmp(*(char* const*)a,*(char* const*)b);
+}
+
+/*
+ *  Read the directory and bring the index up to date
+ *    Reports each change and returns the number of changes
+ */
+int RescanCaptureDir(CapChanged changed)
+{
+   DIR*   dir;
+   struct dirent* ent;
+   char** names=NULL;
+   int    n=0,m=0,i=0,k=0,count=0;
+   if (!dirpath) return 0;
+   //  Sorted list of files now in the directory
+   dir = opendir(dirpath);
+   if (dir)
+   {
+      while ((ent=readdir(dir)))
+      {
+         if (!IsCapture(ent->d_name)) continue;
+         if (n==m)
+         {
+            m = m ? 2*m : 64;
+            names = (char**)realloc(names,m*sizeof(char*));
+            if (!names) Fatal("Cannot allocate memory for capture index\n");
+         }
+         names[n] = strdup(ent->d_name);
+         if (!names[n++]) Fatal("Cannot allocate memory for capture index\n");
+      }
+      closedir(dir);
+   }
+   qsort(names,n,sizeof(char*),CompareName);
+   //  Merge with the index
+   while (i<n || k<Nentry)
+   {
+      int cmp = (i==n) ? 1 : (k==Nentry) ? -1 : strcmp(names[i],entry[k]->name);
+      //  Gone
+      if (cmp>0)
+      {
+         Remove(k,changed);
+         count++;
+      }
+      //  New
+      else if (cmp<0)
+      {
+         Add(names[i++],changed);
+         k++;
+         count++;
+      }
+      //  Still there, maybe changed
+      else
+      {
+         if (Restat(entry[k]))
+         {
+            if (changed) changed(entry[k],CAP_UPDATED);
+            count++;
+         }
+         i++;
+         k++;
+      }
+   }
+   for (i=0;i<n;i++)
+      free(names[i]);
+   free(names);
+   WriteIndex();
+   scanned = time(NULL);
+   return count;
+}
+
+/*
+ *  Start watching a capture directory and index its files
+ *    Returns 0 on success
+ */
+int OpenCaptureDir(const char* path)
+{
+   CloseCaptureDir();
+   dirpath = strdup(path);
+   if (!dirpath) Fatal("Cannot allocate memory for capture index\n");
+#ifdef __linux__
+   //  Watch before scanning so nothing is missed in between
+   watch = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+   if (watch>=0 && inotify_add_watch(watch,path,IN_CREATE|IN_DELETE|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)<0)
+   {
+      close(watch);
+      watch = -1;
+   }
+#endif
+   //  Only files that changed since the index was saved are read
+   ReadIndex();
+   RescanCaptureDir(NULL);
+   if (imap) UnmapFile(imap,ilen);
+   imap = NULL;
+   return 0;
+}
+
+/*
+ *  Apply changes to the directory since the last call
+ *    Reports each change and returns the number of changes
+ */
+int PollCaptureDir(CapChanged changed)
+{
+#ifdef __linux__
+   char  buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+   int   count=0;
+   ssize_t len;
+   if (watch>=0)
+   {
+      while ((len=read(watch,buf,sizeof(buf)))>0)
+      {
+         char* p;
+         for (p=buf;p<buf+len;p+=sizeof(struct inotify_event)+((struct inotify_event*)p)->len)
+         {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            //  Events were lost so start again
+            if (ev->mask&IN_Q_OVERFLOW) return count+RescanCaptureDir(changed);
+            if (!ev->len || !IsCapture(ev->name)) continue;
+            if (ev->mask&(IN_DELETE|IN_MOVED_FROM))
+            {
+               int found,k = Search(ev->name,&found);
+               if (found) Remove(k,changed);
+            }
+            else
+               Add(ev->name,changed);
+            count++;
+         }
+      }
+      WriteIndex();
+      return count;
+   }
+#endif
+   //  No notifications so rescan now and then
+   if (!dirpath || time(NULL)-scanned<RESCAN_INTERVAL) return 0;
+   return RescanCaptureDir(changed);
+}
+
+/*
+ *  Number of captures
+ */
+int CaptureDirCount(void)
+{
+   return Nentry;
+}
+
+/*
+ *  Capture k in name order
+ */
+const CapEntry* CaptureDirEntry(int k)
+{
+   return (k>=0 && k<Nentry) ? entry[k] : NULL;
+}
+
+/*
+ *  Capture with the given id, or NULL if it has gone
+ */
+const CapEntry* CaptureDirFind(int id)
+{
+   return (id>=0 && id<Nid) ? byId[id] : NULL;
+}
+
+/*
+ *  Capture k counting from the most recently modified
+ */
+const CapEntry* CaptureDirNewest(int k)
+{
+   if (k<0 || k>=Nentry) return NULL;
+   return newest[k];
+}
+
+/*
+ *  Days with captures, newest first
+ *    Returns the number of days
+ */
+int CaptureDirDays(const CapDay** days)
+{
+   *days = day;
+   return Nday;
+}
+
+/*
+ *  Stop watching and forget the index
+ */
+void CloseCaptureDir(void)
+{
+   int k;
+#ifdef __linux__
+   if (watch>=0) close(watch);
+   watch = -1;
+#endif
+   WriteIndex();
+   for (k=0;k<Nentry;k++)
+   {
+      free(entry[k]->name);
+      free(entry[k]);
+   }
+   free(entry);
+   free(byId);
+   free(newest);
+   free(day);
+   free(dirpath);
+   entry = byId = newest = NULL;
+   day = NULL;
+   Nentry = Mentry = Nid = Mid = Nday = 0;
+   dirty = 0;
+   dirpath = NULL;
+}
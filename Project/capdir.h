@@ -0,0 +1,48 @@
+#ifndef CAPDIR
+#define CAPDIR
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Capture file in the watched directory
+typedef struct
+{
+   char*     name;       //  File name
+   long long size;       //  Bytes
+   long long mtime;      //  Modification time
+   double    duration;   //  Seconds of capture (0 if unreadable)
+   double    lo[3];      //  Bounding box of the eye path
+   double    hi[3];      //  Bounding box of the eye path
+   int       id;         //  Stable id, never reused
+} CapEntry;
+
+//  Captures modified on one day
+typedef struct
+{
+   int date;             //  Local date as yyyymmdd
+   int first;            //  Newest capture that day in CaptureDirNewest order
+   int count;            //  Number of captures that day
+} CapDay;
+
+//  Changes reported by PollCaptureDir and RescanCaptureDir
+#define CAP_ADDED   0
+#define CAP_REMOVED 1
+#define CAP_UPDATED 2
+typedef void (*CapChanged)(const CapEntry* entry,int change);
+
+int  OpenCaptureDir(const char* path);
+int  PollCaptureDir(CapChanged changed);
+int  RescanCaptureDir(CapChanged changed);
+int  CaptureDirCount(void);
+const CapEntry* CaptureDirEntry(int k);
+const CapEntry* CaptureDirFind(int id);
+const CapEntry* CaptureDirNewest(int k);
+int  CaptureDirDays(const CapDay** days);
+void CloseCaptureDir(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
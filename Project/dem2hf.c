@@ -0,0 +1,21 @@
+/*
+ *  Convert a text DEM into a heightfield for MapHeightField
+ *
+ *  Usage: dem2hf <drp> <hf> [spacing] [width]
+ *  The grid is square unless the number of samples in a row is given
+ */
+#include "CSCIx229.h"
+#include "heightfield.h"
+
+int main(int argc,char* argv[])
+{
+   float spacing = 1;
+   int   nx = 0;
+   if (argc<3 || argc>5) Fatal("Usage: dem2hf <drp> <hf> [spacing] [width]\n");
+   if (argc>=4) spacing = atof(argv[3]);
+   if (argc==5) nx = atoi(argv[4]);
+   if (spacing<=0) Fatal("Spacing must be positive: %s\n",argv[3]);
+   if (argc==5 && nx<2) Fatal("Width must be at least 2: %s\n",argv[4]);
+   SaveHeightField(argv[2],argv[1],spacing,nx);
+   return 0;
+}
@@ -0,0 +1,976 @@
+/*
+ *  Eye capture files
+ *
+ *  While recording, a capture file starts with a header followed by one
+ *  EyeCap per sample (version 1).  Each sample holds the time it was taken
+ *  so playback can interpolate between samples at any frame rate.  Records are collected in a ring in memory
+ *  and a writer thread appends them in blocks, so recording costs a copy on
+ *  the render thread.  After each block the record count in the header is
+ *  updated, and the count is marked final when the capture is closed.  A
+ *  capture cut short by a crash keeps every block written before it.
+ *
+ *  Once closed, the capture is compacted in the background (version 2).
+ *  Each record becomes nine integer channels: the eye in fixed point, the
+ *  view orientation as a quaternion, the distance to the look at point and
+ *  the time.
+ *  Records are grouped in blocks of CAP_KEY that start with a key frame
+ *  stored as is.  The other records store the difference from a linear
+ *  prediction off the previous two, Rice coded with the parameter that
+ *  suits each channel of the block best.  A seek index at the end of the
+ *  file holds the time and offset of each block, so playback can jump to
+ *  any time with a binary search and decode at most one block.
+ *
+ *  Files from before the header was added hold the records followed by an
+ *  unsigned long record count.  Records without a time are taken to be
+ *  CAP_HZ apart.
+ */
+#include "CSCIx229.h"
+#include "eyecap.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+//  Capture file header
+#define CAP_VERSION 2        // Compact captures
+#define CAP_CLOSED  1        // Count is final
+#define CAP_TIMED   2        // Records hold a time
+#define CAP_INDEXED 4        // Seek index at the end (v2)
+typedef struct
+{
+   char      magic[4];       // "ECAP"
+   int       version;        // 1 while recording, CAP_VERSION once compacted
+   int       flags;          // CAP_CLOSED and CAP_TIMED
+   int       recsize;        // Bytes per record (v1) or records per block (v2)
+   long long count;          // Records (checkpointed while recording)
+   long long start;          // Wall clock time recording started
+} cap_t;
+
+//  Seek index entry for each block of a compact capture
+typedef struct
+{
+   double    t;              // Time of the key frame
+   long long offset;         // Offset of the block
+} seek_t;
+//  Last bytes of an indexed capture
+typedef struct
+{
+   long long index;          // Offset of the first seek_t
+   long long blocks;         // Number of seek_t
+   char      magic[4];       // "ESEK"
+   int       pad;
+} foot_t;
+
+//  Records without a time
+#define CAP_HZ    60.0       // Nominal sample rate
+#define UNTIMED   offsetof(EyeCap,t)
+
+//  Records buffered in memory
+#define CAP_RING  4096
+//  Records per write
+#define CAP_BLOCK 256
+
+//  Compact format
+#define CAP_KEY    64        // Records per block
+#define NCHAN      9         // Eye x,y,z, quaternion w,x,y,z, look at distance and time
+#define POS_SCALE  4096.0    // Position steps per unit
+#define ROT_SCALE  32767.0   // Quaternion steps per unit
+#define TIME_SCALE 1000.0    // Time steps per second
+#define RICE_ESC   16        // Quotient that introduces a 32 bit value
+#define BLOCK_BITS (NCHAN*(5+32) + (CAP_KEY-1)*NCHAN*(RICE_ESC+32))
+
+//  Capture in progress
+static FILE*     capture=NULL;
+static char*     capname=NULL;
+static cap_t     header;
+static EyeCap    ring[CAP_RING];
+static int       head=0,n=0;     // Oldest record not on disk and records buffered
+static int       stop=0;         // Close requested
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  more = PTHREAD_COND_INITIALIZER;   // Block ready or stop
+static pthread_cond_t  room = PTHREAD_COND_INITIALIZER;   // Records written
+//  Compaction in progress
+static pthread_t compactor;
+static int       compacting=0;
+
+/*
+ *  Writer thread appends blocks of records
+ */
+static void* Writer(void* arg)
+{
+   while (1)
+   {
+      int k;
+      struct timespec t;
+      //  Wait for a block, a second to pass or stop
+      pthread_mutex_lock(&lock);
+      clock_gettime(CLOCK_REALTIME,&t);
+      t.tv_sec++;
+      while (n<CAP_BLOCK && !stop)
+         if (pthread_cond_timedwait(&more,&lock,&t)) break;
+      if (n==0 && stop)
+      {
+         pthread_mutex_unlock(&lock);
+         break;
+      }
+      //  Records up to the end of the ring
+      k = (head+n>CAP_RING) ? CAP_RING-head : n;
+      pthread_mutex_unlock(&lock);
+      if (k==0) continue;
+
+      //  The render thread only fills slots past head+n so these are safe to read
+      fwrite(ring+head,sizeof(EyeCap),k,capture);
+      //  Checkpoint the count
+      header.count += k;
+      fseek(capture,offsetof(cap_t,count),SEEK_SET);
+      fwrite(&header.count,sizeof(header.count),1,capture);
+      fseek(capture,0,SEEK_END);
+      fflush(capture);
+
+      //  Free the slots
+      pthread_mutex_lock(&lock);
+      head = (head+k)%CAP_RING;
+      n -= k;
+      pthread_cond_signal(&room);
+      pthread_mutex_unlock(&lock);
+   }
+   return NULL;
+}
+
+/*
+ *  View orientation and distance from an eye record
+ *    The quaternion rotates the camera axes (side, up, back) to world axes
+ *    Its sign is chosen to be closest to q0 so channels change smoothly
+ */
+static void EyeToQuat(const EyeCap* e,const double q0[4],double q[4],double* d)
+{
+   double f[3],s[3],u[3],l;
+   double m00,m01,m02,m10,m11,m12,m20,m21,m22,tr,S;
+   //  Forward
+   f[0] = e->Ox-e->Ex;
+   f[1] = e->Oy-e->Ey;
+   f[2] = e->Oz-e->Ez;
+   *d = sqrt(f[0]*f[0]+f[1]*f[1]+f[2]*f[2]);
+   if (*d>0)
+   {
+      f[0] /= *d;
+      f[1] /= *d;
+      f[2] /= *d;
+   }
+   else
+   {
+      f[0] = f[1] = 0;
+      f[2] = -1;
+   }
+   //  Side = forward x up (any perpendicular if up is parallel to forward)
+   s[0] = f[1]*e->Uz-f[2]*e->Uy;
+   s[1] = f[2]*e->Ux-f[0]*e->Uz;
+   s[2] = f[0]*e->Uy-f[1]*e->Ux;
+   l = sqrt(s[0]*s[0]+s[1]*s[1]+s[2]*s[2]);
+   if (l<1e-12)
+   {
+      s[0] = fabs(f[0])<0.9 ? 0 : -f[2];
+      s[1] = fabs(f[0])<0.9 ? -f[2] : 0;
+      s[2] = fabs(f[0])<0.9 ? f[1] : f[0];
+      l = sqrt(s[0]*s[0]+s[1]*s[1]+s[2]*s[2]);
+   }
+   s[0] /= l;
+   s[1] /= l;
+   s[2] /= l;
+   //  True up = side x forward
+   u[0] = s[1]*f[2]-s[2]*f[1];
+   u[1] = s[2]*f[0]-s[0]*f[2];
+   u[2] = s[0]*f[1]-s[1]*f[0];
+   //  Rotation with columns side, up and back
+   m00 = s[0]; m01 = u[0]; m02 = -f[0];
+   m10 = s[1]; m11 = u[1]; m12 = -f[1];
+   m20 = s[2]; m21 = u[2]; m22 = -f[2];
+   tr = m00+m11+m22;
+   if (tr>0)
+   {
+      S = 2*sqrt(tr+1);
+      q[0] = S/4;
+      q[1] = (m21-m12)/S;
+      q[2] = (m02-m20)/S;
+      q[3] = (m10-m01)/S;
+   }
+   else if (m00>m11 && m00>m22)
+   {
+      S = 2*sqrt(1+m00-m11-m22);
+      q[0] = (m21-m12)/S;
+      q[1] = S/4;
+      q[2] = (m01+m10)/S;
+      q[3] = (m02+m20)/S;
+   }
+   else if (m11>m22)
+   {
+      S = 2*sqrt(1+m11-m00-m22);
+      q[0] = (m02-m20)/S;
+      q[1] = (m01+m10)/S;
+      q[2] = S/4;
+      q[3] = (m12+m21)/S;
+   }
+   else
+   {
+      S = 2*sqrt(1+m22-m00-m11);
+      q[0] = (m10-m01)/S;
+      q[1] = (m02+m20)/S;
+      q[2] = (m12+m21)/S;
+      q[3] = S/4;
+   }
+   //  q and -q are the same rotation
+   if (q[0]*q0[0]+q[1]*q0[1]+q[2]*q0[2]+q[3]*q0[3]<0)
+   {
+      q[0] = -q[0];
+      q[1] = -q[1];
+      q[2] = -q[2];
+      q[3] = -q[3];
+   }
+}
+
+/*
+ *  Eye record from eye position, view orientation and distance
+ *    The up vector comes back unit length and perpendicular to the view,
+ *    which gluLookAt makes of it anyway
+ */
+static void QuatToEye(const double E[3],const double Q[4],double d,EyeCap* e)
+{
+   double w=Q[0],x=Q[1],y=Q[2],z=Q[3];
+   double l = sqrt(w*w+x*x+y*y+z*z);
+   if (l>0)
+   {
+      w /= l;
+      x /= l;
+      y /= l;
+      z /= l;
+   }
+   else
+      w = 1;
+   e->Ex = E[0];
+   e->Ey = E[1];
+   e->Ez = E[2];
+   //  Look at point is along minus the third column
+   e->Ox = E[0] - d*2*(x*z+w*y);
+   e->Oy = E[1] - d*2*(y*z-w*x);
+   e->Oz = E[2] - d*(1-2*(x*x+y*y));
+   //  Up is the second column
+   e->Ux = 2*(x*y-w*z);
+   e->Uy = 1-2*(x*x+z*z);
+   e->Uz = 2*(y*z+w*x);
+}
+
+/*
+ *  Round to a channel value
+ */
+static int Quantize(double x,double scale)
+{
+   x = floor(x*scale+0.5);
+   if (x>2147483647.0) return 2147483647;
+   if (x<-2147483647.0) return -2147483647;
+   return (int)x;
+}
+
+/*
+ *  Append n bits (n<=32) to a buffer, most significant first
+ */
+static void PutBits(unsigned char* buf,size_t* bit,unsigned int v,int n)
+{
+   while (n--)
+   {
+      size_t k = (*bit)++;
+      if ((v>>n)&1)
+         buf[k>>3] |= 0x80>>(k&7);
+      else
+         buf[k>>3] &= ~(0x80>>(k&7));
+   }
+}
+
+/*
+ *  Read n bits (n<=32) from len bytes, most significant first
+ *    Bits past the end read as 0
+ */
+static unsigned int GetBits(const unsigned char* buf,size_t len,size_t* bit,int n)
+{
+   unsigned int v=0;
+   while (n--)
+   {
+      size_t k = (*bit)++;
+      v = (v<<1) | ((k>>3)<len ? (buf[k>>3]>>(7-(k&7)))&1 : 0);
+   }
+   return v;
+}
+
+/*
+ *  Map a signed residual to an unsigned one (0,-1,1,-2 -> 0,1,2,3)
+ */
+static unsigned long long ZigZag(long long r)
+{
+   return r<0 ? 2*(unsigned long long)(-(r+1))+1 : 2*(unsigned long long)r;
+}
+
+/*
+ *  Bits to Rice code u with parameter k
+ */
+static int RiceBits(unsigned long long u,int k)
+{
+   return (u>>k)<RICE_ESC ? (int)(u>>k)+1+k : RICE_ESC+32;
+}
+
+/*
+ *  Prediction for record j of a block from the previous two
+ */
+static long long Predict(int j,int v1,int v2)
+{
+   return j>=2 ? 2*(long long)v1-v2 : v1;
+}
+
+/*
+ *  Encode one block of m records
+ *    Returns bytes in buf
+ */
+static size_t EncodeBlock(int v[][NCHAN],int m,int nchan,unsigned char* buf)
+{
+   int    j,c;
+   int    rice[NCHAN];
+   size_t bit=0;
+   //  Pick the Rice parameter for each channel
+   for (c=0;c<nchan;c++)
+   {
+      int k,best=0;
+      long long bits=-1;
+      for (k=0;k<=24;k++)
+      {
+         long long b=0;
+         for (j=1;j<m;j++)
+            b += RiceBits(ZigZag(v[j][c]-Predict(j,v[j-1][c],j>=2?v[j-2][c]:0)),k);
+         if (bits<0 || b<bits)
+         {
+            bits = b;
+            best = k;
+         }
+      }
+      rice[c] = best;
+      PutBits(buf,&bit,best,5);
+   }
+   //  Key frame
+   for (c=0;c<nchan;c++)
+      PutBits(buf,&bit,(unsigned int)v[0][c],32);
+   //  Residuals
+   for (j=1;j<m;j++)
+      for (c=0;c<nchan;c++)
+      {
+         unsigned long long u = ZigZag(v[j][c]-Predict(j,v[j-1][c],j>=2?v[j-2][c]:0));
+         int k = rice[c];
+         if ((u>>k)<RICE_ESC)
+         {
+            PutBits(buf,&bit,(1u<<(u>>k))-1,u>>k);
+            PutBits(buf,&bit,0,1);
+            PutBits(buf,&bit,u&((1ull<<k)-1),k);
+         }
+         //  Escape to the value itself
+         else
+         {
+            PutBits(buf,&bit,(1u<<RICE_ESC)-1,RICE_ESC);
+            PutBits(buf,&bit,(unsigned int)v[j][c],32);
+         }
+      }
+   return (bit+7)/8;
+}
+
+/*
+ *  Rewrite a closed capture in the compact format
+ *    Runs on its own thread and replaces the file when done
+ */
+static void* Compact(void* arg)
+{
+   char*       file = (char*)arg;
+   char*       tmp;
+   EyeCapFile  cap;
+   cap_t       h;
+   FILE*       f;
+   long long   k,off;
+   seek_t*     index;
+   foot_t      foot;
+   double      q0[4] = {1,0,0,0};
+   int         err;
+   static int  v[CAP_KEY][NCHAN];
+   static unsigned char buf[BLOCK_BITS/8+1];
+
+   //  Only plain captures are compacted
+   if (MapEyeCapture(file,&cap))
+   {
+      free(file);
+      return NULL;
+   }
+   if (cap.version!=1)
+   {
+      UnmapEyeCapture(&cap);
+      free(file);
+      return NULL;
+   }
+   memcpy(&h,cap.map,sizeof(h));
+   h.version = CAP_VERSION;
+   h.flags |= CAP_CLOSED|CAP_TIMED|CAP_INDEXED;
+   h.recsize = CAP_KEY;
+   h.count = cap.n;
+
+   //  Write to a temporary file and rename so a partial file is never seen
+   tmp = (char*)malloc(strlen(file)+5);
+   index = (seek_t*)malloc((cap.n/CAP_KEY+1)*sizeof(seek_t));
+   if (!tmp || !index) Fatal("Cannot allocate memory for eye capture %s\n",file);
+   sprintf(tmp,"%s.tmp",file);
+   f = fopen(tmp,"wb");
+   if (!f)
+   {
+      fprintf(stderr,"Cannot compact eye capture %s\n",file);
+      UnmapEyeCapture(&cap);
+      free(index);
+      free(tmp);
+      free(file);
+      return NULL;
+   }
+   fwrite(&h,sizeof(h),1,f);
+   off = sizeof(h);
+   for (k=0;k<cap.n;k+=CAP_KEY)
+   {
+      int j,m = (cap.n-k<CAP_KEY) ? cap.n-k : CAP_KEY;
+      unsigned int len;
+      //  Channels
+      for (j=0;j<m;j++)
+      {
+         EyeCap eye,*e=&eye;
+         double q[4],d;
+         GetEyeCapture(&cap,k+j,e);
+         EyeToQuat(e,q0,q,&d);
+         memcpy(q0,q,sizeof(q0));
+         v[j][0] = Quantize(e->Ex,POS_SCALE);
+         v[j][1] = Quantize(e->Ey,POS_SCALE);
+         v[j][2] = Quantize(e->Ez,POS_SCALE);
+         v[j][3] = Quantize(q[0],ROT_SCALE);
+         v[j][4] = Quantize(q[1],ROT_SCALE);
+         v[j][5] = Quantize(q[2],ROT_SCALE);
+         v[j][6] = Quantize(q[3],ROT_SCALE);
+         v[j][7] = Quantize(d,POS_SCALE);
+         v[j][8] = Quantize(e->t,TIME_SCALE);
+      }
+      //  Block length and bits
+      len = EncodeBlock(v,m,NCHAN,buf);
+      fwrite(&len,sizeof(len),1,f);
+      fwrite(buf,len,1,f);
+      //  Index the key frame as it will be decoded
+      index[k/CAP_KEY].t = v[0][8]/TIME_SCALE;
+      index[k/CAP_KEY].offset = off;
+      off += sizeof(len)+len;
+   }
+   //  Seek index
+   memset(&foot,0,sizeof(foot));
+   foot.index = off;
+   foot.blocks = (cap.n+CAP_KEY-1)/CAP_KEY;
+   memcpy(foot.magic,"ESEK",4);
+   fwrite(index,sizeof(seek_t),foot.blocks,f);
+   fwrite(&foot,sizeof(foot),1,f);
+   free(index);
+   UnmapEyeCapture(&cap);
+   err = ferror(f);
+   if (fclose(f) || err || rename(tmp,file))
+   {
+      fprintf(stderr,"Cannot compact eye capture %s\n",file);
+      remove(tmp);
+   }
+   free(tmp);
+   free(file);
+   return NULL;
+}
+
+/*
+ *  Wait for the last capture to be compacted
+ */
+static void WaitCompact(void)
+{
+   if (!compacting) return;
+   pthread_join(compactor,NULL);
+   compacting = 0;
+}
+
+/*
+ *  Close the capture if the program exits while recording
+ */
+static void CloseAtExit(void)
+{
+   CloseEyeCapture();
+   WaitCompact();
+}
+
+/*
+ *  Start recording to a capture file
+ *    Returns 0 on success
+ */
+int OpenEyeCapture(const char* file)
+{
+   static int atexitSet=0;
+   if (capture) return -1;
+   capname = strdup(file);
+   capture = capname ? fopen(file,"wb") : NULL;
+   if (!capture)
+   {
+      free(capname);
+      capname = NULL;
+      return -1;
+   }
+   //  Header
+   memset(&header,0,sizeof(header));
+   memcpy(header.magic,"ECAP",4);
+   header.version = 1;
+   header.flags = CAP_TIMED;
+   header.recsize = sizeof(EyeCap);
+   header.start = time(NULL);
+   if (fwrite(&header,sizeof(header),1,capture)!=1 || fflush(capture))
+   {
+      fclose(capture);
+      capture = NULL;
+      free(capname);
+      capname = NULL;
+      return -1;
+   }
+   //  Start writer
+   head = n = stop = 0;
+   if (pthread_create(&writer,NULL,Writer,NULL)) Fatal("Cannot start capture writer for %s\n",file);
+   if (!atexitSet) atexit(CloseAtExit);
+   atexitSet = 1;
+   return 0;
+}
+
+/*
+ *  Record one frame
+ *    Copies into the ring and only waits if the writer is a whole ring behind
+ */
+void WriteEyeCapture(const EyeCap* eye)
+{
+   if (!capture) return;
+   pthread_mutex_lock(&lock);
+   while (n==CAP_RING)
+      pthread_cond_wait(&room,&lock);
+   ring[(head+n)%CAP_RING] = *eye;
+   n++;
+   if (n>=CAP_BLOCK) pthread_cond_signal(&more);
+   pthread_mutex_unlock(&lock);
+}
+
+/*
+ *  Finish recording
+ *    Writes the remaining records, marks the count final and starts compaction
+ */
+void CloseEyeCapture(void)
+{
+   int err;
+   if (!capture) return;
+   //  Stop writer once everything is written
+   pthread_mutex_lock(&lock);
+   stop = 1;
+   pthread_cond_signal(&more);
+   pthread_mutex_unlock(&lock);
+   pthread_join(writer,NULL);
+   //  Final header
+   header.flags |= CAP_CLOSED;
+   fseek(capture,0,SEEK_SET);
+   fwrite(&header,sizeof(header),1,capture);
+   err = ferror(capture);
+   if (fclose(capture) || err) fprintf(stderr,"Error writing eye capture\n");
+   capture = NULL;
+   //  Compact in the background (the thread frees capname)
+   WaitCompact();
+   if (pthread_create(&compactor,NULL,Compact,capname))
+      free(capname);
+   else
+      compacting = 1;
+   capname = NULL;
+}
+
+/*
+ *  Read the seek index of a compact capture with nb blocks
+ *    Returns 0 if the index is missing or does not match the file
+ */
+static int ReadIndex(EyeCapFile* cap,long long nb)
+{
+   long long b,next=sizeof(cap_t);
+   foot_t    foot;
+   const char* map = (const char*)cap->map;
+   if (cap->len<sizeof(cap_t)+sizeof(foot)) return 0;
+   memcpy(&foot,map+cap->len-sizeof(foot),sizeof(foot));
+   if (memcmp(foot.magic,"ESEK",4) || foot.blocks!=nb || foot.index<(long long)sizeof(cap_t) ||
+       foot.index+nb*(long long)sizeof(seek_t)+(long long)sizeof(foot)!=(long long)cap->len)
+      return 0;
+   for (b=0;b<nb;b++)
+   {
+      seek_t       s;
+      unsigned int len;
+      memcpy(&s,map+foot.index+b*sizeof(seek_t),sizeof(s));
+      //  Blocks must follow each other and end before the index
+      if (s.offset!=next || next+(long long)sizeof(len)>foot.index) return 0;
+      memcpy(&len,map+s.offset,sizeof(len));
+      next += sizeof(len)+len;
+      if (next>foot.index) return 0;
+      cap->offset[b] = s.offset;
+      cap->start[b] = s.t;
+   }
+   return 1;
+}
+
+/*
+ *  Time of the key frame of block b of a compact capture
+ */
+static double KeyTime(EyeCapFile* cap,long long b)
+{
+   const unsigned char* p = (const unsigned char*)cap->map + cap->offset[b];
+   unsigned int len;
+   size_t bit = cap->nchan*(5+32) - 32;
+   if (cap->nchan<NCHAN) return b*cap->block/CAP_HZ;
+   memcpy(&len,p,sizeof(len));
+   return (int)GetBits(p+sizeof(len),len,&bit,32)/TIME_SCALE;
+}
+
+/*
+ *  Map a capture file for playback
+ *    Plain records are used in place without copying
+ *    The count is limited to the whole records actually in the file
+ *    Returns 0 on success
+ */
+int MapEyeCapture(const char* file,EyeCapFile* cap)
+{
+   const cap_t* h;
+   long long    count;
+   memset(cap,0,sizeof(EyeCapFile));
+   cap->cur = cap->at = -1;
+   cap->map = MapFile(file,&cap->len);
+   if (!cap->map) return -1;
+   h = (const cap_t*)cap->map;
+   //  Compact capture
+   if (cap->len>=sizeof(cap_t) && !memcmp(h->magic,"ECAP",4) && h->version==CAP_VERSION)
+   {
+      long long b,nb;
+      size_t    off = sizeof(cap_t);
+      if (h->recsize<1 || h->count<0)
+      {
+         UnmapEyeCapture(cap);
+         return -1;
+      }
+      cap->version = CAP_VERSION;
+      cap->block = h->recsize;
+      cap->nchan = (h->flags&CAP_TIMED) ? NCHAN : NCHAN-1;
+      //  Block offsets and times from the seek index
+      nb = (h->count+cap->block-1)/cap->block;
+      cap->offset = (long long*)malloc((nb+1)*sizeof(long long));
+      cap->start = (double*)malloc((nb+1)*sizeof(double));
+      if (!cap->offset || !cap->start) Fatal("Cannot allocate memory for eye capture %s\n",file);
+      if ((h->flags&CAP_INDEXED) && ReadIndex(cap,nb))
+         b = nb;
+      //  Otherwise walk the blocks
+      else
+         for (b=0;b<nb;b++)
+         {
+            unsigned int len;
+            if (off+sizeof(len)>cap->len) break;
+            memcpy(&len,(const char*)cap->map+off,sizeof(len));
+            if (len>cap->len-off-sizeof(len)) break;
+            cap->offset[b] = off;
+            cap->start[b] = KeyTime(cap,b);
+            off += sizeof(len)+len;
+         }
+      //  Keep the blocks that are all there
+      count = b*cap->block;
+      if (h->count<count) count = h->count;
+   }
+   //  Capture with header
+   else if (cap->len>=sizeof(cap_t) && !memcmp(h->magic,"ECAP",4))
+   {
+      int timed = (h->flags&CAP_TIMED)!=0;
+      if (h->version!=1 || h->recsize!=(timed?sizeof(EyeCap):UNTIMED))
+      {
+         UnmapEyeCapture(cap);
+         return -1;
+      }
+      cap->version = 1;
+      cap->rec = (const char*)(h+1);
+      cap->recsize = h->recsize;
+      count = (cap->len-sizeof(cap_t))/cap->recsize;
+      //  A closed capture has a final count, otherwise use whatever was written
+      if ((h->flags&CAP_CLOSED) && h->count<count) count = h->count;
+   }
+   //  Old capture with trailing count
+   else
+   {
+      unsigned long n;
+      cap->rec = (const char*)cap->map;
+      cap->recsize = UNTIMED;
+      count = cap->len<sizeof(n) ? 0 : (cap->len-sizeof(n))/UNTIMED;
+      if (count>0)
+      {
+         memcpy(&n,(const char*)cap->map+cap->len-sizeof(n),sizeof(n));
+         if ((long long)n<count) count = n;
+      }
+   }
+   cap->n = count;
+   //  Length of the capture
+   if (count>0)
+   {
+      EyeCap last;
+      GetEyeCapture(cap,count-1,&last);
+      cap->end = last.t;
+   }
+   return 0;
+}
+
+/*
+ *  Decode the next record of a compact capture
+ */
+static void NextRecord(EyeCapFile* cap)
+{
+   int c;
+   int j = ++cap->cur % cap->block;
+   const unsigned char* p = (const unsigned char*)cap->map + cap->offset[cap->cur/cap->block];
+   unsigned int len;
+   memcpy(&len,p,sizeof(len));
+   p += sizeof(len);
+   //  Rice parameters and key frame
+   if (j==0)
+   {
+      cap->bit = 0;
+      for (c=0;c<cap->nchan;c++)
+         cap->rice[c] = GetBits(p,len,&cap->bit,5);
+      for (c=0;c<cap->nchan;c++)
+         cap->val[c] = (int)GetBits(p,len,&cap->bit,32);
+      return;
+   }
+   //  Residuals
+   for (c=0;c<cap->nchan;c++)
+   {
+      int k = cap->rice[c];
+      int v;
+      unsigned long long q=0;
+      while (q<RICE_ESC && GetBits(p,len,&cap->bit,1))
+         q++;
+      if (q==RICE_ESC)
+         v = (int)GetBits(p,len,&cap->bit,32);
+      else
+      {
+         unsigned long long u = (q<<k) | GetBits(p,len,&cap->bit,k);
+         long long r = (u&1) ? -(long long)(u>>1)-1 : (long long)(u>>1);
+         v = (int)(Predict(j,cap->val[c],cap->prev[c])+r);
+      }
+      cap->prev[c] = cap->val[c];
+      cap->val[c] = v;
+   }
+}
+
+/*
+ *  Get record k of a capture
+ *    Compact captures decode forward from the key frame of the block,
+ *    so stepping through in order decodes each record once
+ *    Returns 0 on success
+ */
+int GetEyeCapture(EyeCapFile* cap,long long k,EyeCap* eye)
+{
+   double E[3],Q[4];
+   if (k<0 || k>=cap->n) return -1;
+   //  Plain records
+   if (cap->version<CAP_VERSION)
+   {
+      memcpy(eye,cap->rec+k*cap->recsize,cap->recsize);
+      if (cap->recsize==UNTIMED) eye->t = k/CAP_HZ;
+      return 0;
+   }
+   //  Restart at the key frame unless k is further on in the same block
+   if (cap->cur<0 || cap->cur>k || cap->cur/cap->block!=k/cap->block)
+      cap->cur = k/cap->block*cap->block - 1;
+   while (cap->cur<k)
+      NextRecord(cap);
+   //  Channels to eye
+   E[0] = cap->val[0]/POS_SCALE;
+   E[1] = cap->val[1]/POS_SCALE;
+   E[2] = cap->val[2]/POS_SCALE;
+   Q[0] = cap->val[3]/ROT_SCALE;
+   Q[1] = cap->val[4]/ROT_SCALE;
+   Q[2] = cap->val[5]/ROT_SCALE;
+   Q[3] = cap->val[6]/ROT_SCALE;
+   QuatToEye(E,Q,cap->val[7]/POS_SCALE,eye);
+   eye->t = (cap->nchan==NCHAN) ? cap->val[8]/TIME_SCALE : k/CAP_HZ;
+   return 0;
+}
+
+/*
+ *  Interpolate between two records
+ *    Eye and distance are linear and the view orientation is spherical
+ */
+static void LerpEye(const EyeCap* a,const EyeCap* b,double f,EyeCap* eye)
+{
+   int    i;
+   double E[3],Q[4],qa[4],qb[4],da,db,cosw;
+   const double q0[4] = {1,0,0,0};
+   EyeToQuat(a,q0,qa,&da);
+   //  Take the short way round
+   EyeToQuat(b,qa,qb,&db);
+   E[0] = a->Ex+f*(b->Ex-a->Ex);
+   E[1] = a->Ey+f*(b->Ey-a->Ey);
+   E[2] = a->Ez+f*(b->Ez-a->Ez);
+   //  Slerp (lerp when nearly parallel, QuatToEye normalizes)
+   cosw = qa[0]*qb[0]+qa[1]*qb[1]+qa[2]*qb[2]+qa[3]*qb[3];
+   if (cosw>0.9995)
+      for (i=0;i<4;i++)
+         Q[i] = qa[i]+f*(qb[i]-qa[i]);
+   else
+   {
+      double w = acos(cosw);
+      double sa = sin((1-f)*w)/sin(w);
+      double sb = sin(f*w)/sin(w);
+      for (i=0;i<4;i++)
+         Q[i] = sa*qa[i]+sb*qb[i];
+   }
+   QuatToEye(E,Q,da+f*(db-da),eye);
+   eye->t = a->t+f*(b->t-a->t);
+}
+
+/*
+ *  Time of record k
+ */
+static double RecordTime(EyeCapFile* cap,long long k)
+{
+   EyeCap eye;
+   //  Read just the time of plain records
+   if (cap->version<CAP_VERSION && cap->recsize==sizeof(EyeCap))
+   {
+      memcpy(&eye.t,cap->rec+k*cap->recsize+offsetof(EyeCap,t),sizeof(eye.t));
+      return eye.t;
+   }
+   GetEyeCapture(cap,k,&eye);
+   return eye.t;
+}
+
+/*
+ *  Last record at or before time t (the first record if there is none)
+ *    Binary search over plain records or the seek index of compact ones
+ */
+static long long Locate(EyeCapFile* cap,double t)
+{
+   long long lo=0,hi=cap->n-1;
+   //  Block holding t, then forward through the block
+   if (cap->version==CAP_VERSION)
+   {
+      long long k,end;
+      hi = (cap->n+cap->block-1)/cap->block - 1;
+      while (lo<hi)
+      {
+         long long mid = (lo+hi+1)/2;
+         if (cap->start[mid]<=t)
+            lo = mid;
+         else
+            hi = mid-1;
+      }
+      k = lo*cap->block;
+      end = (k+cap->block<cap->n) ? k+cap->block : cap->n;
+      while (k+1<end && RecordTime(cap,k+1)<=t)
+         k++;
+      return k;
+   }
+   while (lo<hi)
+   {
+      long long mid = (lo+hi+1)/2;
+      if (RecordTime(cap,mid)<=t)
+         lo = mid;
+      else
+         hi = mid-1;
+   }
+   return lo;
+}
+
+/*
+ *  Make record k and the next the pair to interpolate between
+ */
+static void Position(EyeCapFile* cap,long long k)
+{
+   cap->at = k;
+   GetEyeCapture(cap,k,&cap->a);
+   if (k+1<cap->n) GetEyeCapture(cap,k+1,&cap->b);
+}
+
+/*
+ *  Camera at time t of a capture
+ *    Interpolates between the records either side of t
+ *    Playing forward reads each record once and other jumps seek
+ *    Returns 0 while t is within the capture and 1 past the end
+ */
+int SampleEyeCapture(EyeCapFile* cap,double t,EyeCap* eye)
+{
+   int k;
+   if (cap->n<=0) return -1;
+   //  Seek when going back
+   if (cap->at<0 || t<cap->a.t)
+      Position(cap,Locate(cap,t));
+   //  Move forward to the records either side of t, seeking if that is far
+   for (k=0;cap->at+1<cap->n && cap->b.t<=t;k++)
+   {
+      if (k==CAP_KEY)
+      {
+         Position(cap,Locate(cap,t));
+         break;
+      }
+      cap->a = cap->b;
+      cap->at++;
+      if (cap->at+1<cap->n) GetEyeCapture(cap,cap->at+1,&cap->b);
+   }
+   //  Hold the last record
+   if (cap->at+1>=cap->n)
+   {
+      *eye = cap->a;
+      return t>cap->a.t;
+   }
+   //  Before the first record or in between
+   if (t<=cap->a.t || cap->b.t<=cap->a.t)
+      *eye = cap->a;
+   else
+      LerpEye(&cap->a,&cap->b,(t-cap->a.t)/(cap->b.t-cap->a.t),eye);
+   eye->t = t;
+   return 0;
+}
+
+/*
+ *  Jump to time t of a capture
+ *    Returns t limited to the capture
+ */
+double SeekEyeCapture(EyeCapFile* cap,double t)
+{
+   if (cap->n<=0) return 0;
+   if (t>cap->end) t = cap->end;
+   if (t<0) t = 0;
+   Position(cap,Locate(cap,t));
+   return t;
+}
+
+/*
+ *  Step a number of records forward or back from time t
+ *    Stepping back from between two records lands on the earlier one
+ *    Returns the time of the record stepped to
+ */
+double StepEyeCapture(EyeCapFile* cap,double t,int steps)
+{
+   long long k;
+   if (cap->n<=0) return 0;
+   k = Locate(cap,t);
+   if (steps<0 && RecordTime(cap,k)<t) steps++;
+   k += steps;
+   if (k<0) k = 0;
+   if (k>=cap->n) k = cap->n-1;
+   Position(cap,k);
+   return cap->a.t;
+}
+
+/*
+ *  Release a capture mapped by MapEyeCapture
+ */
+void UnmapEyeCapture(EyeCapFile* cap)
+{
+   UnmapFile(cap->map,cap->len);
+   free(cap->offset);
+   free(cap->start);
+   memset(cap,0,sizeof(EyeCapFile));
+   cap->cur = cap->at = -1;
+}
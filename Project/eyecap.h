@@ -0,0 +1,62 @@
+#ifndef EYECAP
+#define EYECAP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Eye position, look at point and up vector for one frame
+typedef struct EyeCap
+{
+   double Ex;   //  Eye
+   double Ey;   //  Eye
+   double Ez;   //  Eye
+   double Ox;   //  LookAt
+   double Oy;   //  LookAt
+   double Oz;   //  LookAt
+   double Ux;   //  Up
+   double Uy;   //  Up
+   double Uz;   //  Up
+   double t;    //  Seconds since capture started
+} EyeCap;
+
+//  Capture mapped for playback
+typedef struct
+{
+   void*         map;      //  Mapped file
+   size_t        len;      //  Length of mapping
+   int           version;  //  File format
+   const char*   rec;      //  Records in the mapping (plain files)
+   int           recsize;  //  Bytes per record (plain files)
+   long long     n;        //  Number of records
+   double        end;      //  Time of the last record
+   //  Decoder state (compact files)
+   int           block;    //  Records per block
+   int           nchan;    //  Channels per record
+   long long*    offset;   //  Block offsets
+   double*       start;    //  Block start times
+   long long     cur;      //  Last record decoded
+   int           val[9];   //  Channels of that record
+   int           prev[9];  //  Channels of the one before
+   int           rice[9];  //  Rice parameters of the block
+   size_t        bit;      //  Position in the block
+   //  Interpolation state
+   long long     at;       //  Record at or before the last time sampled
+   EyeCap        a,b;      //  That record and the next
+} EyeCapFile;
+
+int  OpenEyeCapture(const char* file);
+void WriteEyeCapture(const EyeCap* eye);
+void CloseEyeCapture(void);
+int  MapEyeCapture(const char* file,EyeCapFile* cap);
+int  GetEyeCapture(EyeCapFile* cap,long long k,EyeCap* eye);
+int  SampleEyeCapture(EyeCapFile* cap,double t,EyeCap* eye);
+double SeekEyeCapture(EyeCapFile* cap,double t);
+double StepEyeCapture(EyeCapFile* cap,double t,int steps);
+void UnmapEyeCapture(EyeCapFile* cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -83,17 +83,30 @@ Use arrow keys to change viewing angles
 */
 
 #include "CSCIx229.h"
+#include "eyecap.h"
+#include "journal.h"
+#include "capdir.h"
+#include "terrain.h"
+#include "tiles.h"
+#include "flag.h"
 #include <stdbool.h>
 #include <time.h>
 #include <strings.h>
-#include <dirent.h>
 
 #define GL_NORMAL(a,b,c,p,q,r,x,y,z)  glNormal3d(((q-b)*(z-c))-((y-b)*(r-c)),-((p-a)*(z-c))-((x-a)*(r-c)),((p-a)*(y-b))-((x-a)*(q-b)))
 #define rgb(r,g,b) glColor3ub(r,g,b)
 #define PI 3.1415926
 #define FPV_ANGLE 1
 #define FPV_UNIT 0.01
-#define MAX_FILENAME_LENGTH 32
+#define PB_FPS 20   //  Source frame rate of the playback clip
+#define TEX_UPLOAD_BUDGET 1048576   //  Bytes of decoded textures uploaded per frame
+#define VIEW_PAGE 20   //  Captures on each page of the view menu
+#define PLAY_JUMP 5   //  Seconds skipped by the capture playback back/forward controls
+#define ASTRONAUT_FEET 10   //  Distance from the astronaut's location down to his feet (see draw_obj)
+#define MAX_SLOPE 60   //  Steepest ground the astronaut can walk up (degrees)
+#define REGION_SCALE 0.0625   //  World units per unit of the streamed region
+#define REGION_RADIUS 192   //  Region tiles within this many world units of the eye are loaded
+#define REGION_BUDGET (192LL<<20)   //  Bytes of resident region tiles
 
 int axes = 0;       //  Display axes
 int mode = 1;       //  Projection mode
@@ -127,9 +140,11 @@ float shiny   =   1;  // Shininess (value)
 int zh        =  90;  // Light azimuth
 float ylight  =   0;  // Elevation of light
 
-float z[65][65];       //  DEM data
-float zmin=+1e8;       //  DEM lowest location
-float zmax=-1e8;       //  DEM highest location
+HeightField dem;       //  DEM data
+int mountains;         //  DEM mesh shared by the mountain ranges
+double terrainError=2; //  Screen space error allowed in the terrain (pixels)
+int terrainTris=0;     //  Terrain triangles drawn in the last frame
+bool region = false;   //  Ground streamed from a tile store (--region)
 float zmag=5;          //  DEM magnification
 
 bool show_sky, show_overlay, show_pb_screen;
@@ -172,35 +187,40 @@ double Ey = 1;   //  Eye
 double Ez = 1;   //  Eye
 
 int lm = 0;
-double flag[64][64][3];
 unsigned int tex_flag = 0;
 
 int winX = 1000, winY = 1000, mouseX = 500, mouseY = 500;
-int mainMenu, viewMenu;
+int mainMenu, viewMenu, dateMenu;
 bool boolRefreshViewMenu = true;
+bool boolViewMenuChanged = false;
+bool menuInUse = false;
+bool boolCaptureMenuChanged = false;
 bool boolMissionAccomplished = false;
 bool boolCollisionDetected = false;
-unsigned int viewMenuFileEntries = 0;
-char *filenameList;
-unsigned int viewFileIndex;
+// View menu values, captures are chosen by id + VIEW_FILE
+enum ViewCommands {VIEW_NONE, VIEW_REFRESH, VIEW_NEWER, VIEW_OLDER, VIEW_FILE};
+int viewMenuItems = 0, dateMenuItems = 0;   //  Entries after the fixed ones
+int viewFirst = 0;   //  First capture on the page, counting from the newest
+int viewFileId;
 
 enum EyeCapStates {IDLE, INIT, RUNNING, STOP};
 enum EyeCapStates capState = IDLE;
 enum EyeCapStates viewState = IDLE;
 struct timespec current_time;
+double capRate = 0;     //  Capture samples per second (0 = every frame)
+double playSpeed = 1;   //  Playback speed multiplier
+double playTime = 0;    //  Playback position in seconds
+double playLength = 0;  //  Length of the capture being played
+bool playPaused = false;
 
-typedef struct EyeCap
-{
-  double Ex;   //  Eye
-  double Ey;   //  Eye
-  double Ez;   //  Eye
-  double Ox;   //  LookAt
-  double Oy;   //  LookAt
-  double Oz;   //  LookAt
-  double Ux;   //  Up
-  double Uy;   //  Up
-  double Uz;   //  Up
-} EyeCap;
+enum PlayCommands {PLAY_NONE, PLAY_PAUSE, PLAY_STEP_BACK, PLAY_STEP_FORWARD, PLAY_BACK, PLAY_FORWARD, PLAY_RESTART, PLAY_STOP};
+enum PlayCommands playCommand = PLAY_NONE;
+
+int frameTick = 0;          //  Frames drawn, which orders the input journal
+bool replaying = false;     //  Driven by a journal instead of the user
+double replayClock = 0;     //  Game clock while replaying
+JournalFile replay;
+long long replayNext = 0;   //  Next journal event to replay
 
 typedef struct {float x,y,z;} Point;
 typedef struct {double x,y,z;} Location;
@@ -214,34 +234,64 @@ static void draw_cylinder(float x, float y, float z, float th, float ph, float R
 static void draw_sphere(double x, double y, double z, double dx, double dy, double dz);
 static void refreshViewMenu(void);
 static void exitProgram(void);
+void on_timer(int value);
 
 /* ############################################################################################################### */
 
+// Capture rate for the HUD
+static const char* rateName(double rate)
+{
+  static char name[16];
+  if(rate <= 0)
+    return "Every Frame";
+  sprintf(name, "%g Hz", rate);
+  return name;
+}
+
+// Game clock in seconds, which a replay takes from the journal
+static double game_clock(void)
+{
+  return replaying ? replayClock : glutGet(GLUT_ELAPSED_TIME) / 1000.0;
+}
+
 static void eyeCapture(double Epx, double Epy, double Epz, double Eox, double Eoy, double Eoz, double Eux, double Euy, double Euz)
 {
   EyeCap eye;
-  static FILE *capture;
-  static char filename[MAX_FILENAME_LENGTH];
-  static unsigned long current = 0;
-  //size_t bytes = 0;
+  static double start = 0, next = 0;
+  double t;
 
   if(capState == INIT)
   {
+    char *filename;
+    int len;
     //printf("Entered INIT.\n");
-    current = 0;
     bzero(&current_time, sizeof(time_t));
     clock_gettime(CLOCK_MONOTONIC, &current_time);
-    bzero(filename, MAX_FILENAME_LENGTH);
+    len = snprintf(NULL, 0, "capture/eye_%ld.cap", current_time.tv_sec);
+    if((filename = malloc(len + 1)) == NULL)
+      Fatal("Cannot allocate memory for capture file name\n");
     sprintf(filename, "capture/eye_%ld.cap", current_time.tv_sec);
     //printf("Filename = %s.\n", filename);
-    capture = fopen(filename, "wb");
+    if(OpenEyeCapture(filename) != 0)
+    {
+      printf("Error creating capture file \"%s\"\n", filename);
+      free(filename);
+      capState = IDLE;
+      return;
+    }
+    free(filename);
+    start = game_clock();
+    next = 0;
     capState = RUNNING;
-    glutChangeToMenuEntry(1, "Stop Capture", 1);
+    boolCaptureMenuChanged = true;
   }
 
-  if(capState == RUNNING)
+  // Sample the camera at capRate, and always once more on STOP so playback reaches the end
+  t = game_clock() - start;
+  if((capState == RUNNING && t >= next) || capState == STOP)
   {
     bzero(&eye, sizeof(eye));
+    eye.t = t;
     eye.Ex = Epx;
     eye.Ey = Epy;
     eye.Ez = Epz;
@@ -253,57 +303,50 @@ static void eyeCapture(double Epx, double Epy, double Epz, double Eox, double Eo
     eye.Uz = Euz;
 
     //printf("EC: %lf %lf %lf %lf %lf %lf %lf %lf %lf.\n", eye.Ex, eye.Ey, eye.Ez, eye.Ox, eye.Oy, eye.Oz, eye.Ux, eye.Uy, eye.Uz);
-    fwrite ((const void *) &eye , sizeof(eye), 1, capture);
-    current++;
+    WriteEyeCapture(&eye);
+    next = (capRate > 0) ? t + 1 / capRate : 0;
   }
 
-  else if(capState == STOP)
+  if(capState == STOP)
   {
-    fwrite(&current, sizeof(current), 1, capture);
-    fclose(capture);
+    CloseEyeCapture();
     //printf("STOP request. Bytes: %lu.\n", bytes);
     capState = IDLE;
-    glutChangeToMenuEntry(1, "Start Capture", 1);
-    refreshViewMenu();
+    boolCaptureMenuChanged = true;
   }
 }
 
 static void eyeCapViewer(double Epx, double Epy, double Epz, double Eox, double Eoy, double Eoz, double Eux, double Euy, double Euz)
 {
   static EyeCap saveEye, currEye;
-  static FILE *viewer;
-  static unsigned char *import;
-  static unsigned long current = 0, total_entries = 0;
-  static char path[MAX_FILENAME_LENGTH + 8];
+  static EyeCapFile cap;
+  static double last;
+  const CapEntry *entry;
+  char *path = NULL;
   //size_t bytes = 0;
 
   if(viewState == INIT)
   {
     //printf("Entered INIT.\n");
-    total_entries = 0;
-    current = 0;
-
-    bzero(path, MAX_FILENAME_LENGTH + 8);
-    sprintf(path, "capture/%s", filenameList + ((viewFileIndex - 2) * MAX_FILENAME_LENGTH));
+    playTime = 0;
+    playPaused = false;
+    playCommand = PLAY_NONE;
+    last = game_clock();
+
+    entry = CaptureDirFind(viewFileId);
+    if(entry && (path = malloc(strlen(entry->name) + 9)) != NULL)
+      sprintf(path, "capture/%s", entry->name);
     //printf("Reading capture file \"%s\"\n", path);
-    viewer = fopen(path, "rb");
-
-    if(viewer == NULL)
+    if(path == NULL || MapEyeCapture(path, &cap) != 0 || cap.n <= 0)
     {
-      printf("Error reading capture file \"%s\"\n", filenameList + ((viewFileIndex - 2) * MAX_FILENAME_LENGTH));
+      printf("Error reading capture file \"%s\"\n", entry ? entry->name : "(removed)");
+      UnmapEyeCapture(&cap);
+      free(path);
+      viewState = IDLE;
       return;
     }
-
-    fseek(viewer, -sizeof(unsigned long), SEEK_END);
-    fread (&total_entries, sizeof(unsigned long), 1, viewer);
-    //printf("Units read = %lu. Number of entries = %lu.\n", bytes, total_entries);
-
-    import = (unsigned char *) malloc(sizeof(EyeCap) * total_entries);
-    bzero(import, sizeof(EyeCap) * total_entries);
-    rewind(viewer);
-    fread (import, sizeof(unsigned char), sizeof(EyeCap) * total_entries, viewer);
-
-    fclose(viewer);
+    free(path);
+    playLength = cap.end;
 
     bzero(&saveEye, sizeof(saveEye));
     saveEye.Ex = Epx;
@@ -321,8 +364,32 @@ static void eyeCapViewer(double Epx, double Epy, double Epz, double Eox, double
 
   if(viewState == RUNNING)
   {
+    // Advance playback time by the game clock so speed is independent of frame rate
+    if(!playPaused)
+      playTime += playSpeed * (game_clock() - last);
+    last = game_clock();
+
+    // Transport controls
+    if(playCommand == PLAY_PAUSE)
+      playPaused = !playPaused;
+    else if(playCommand == PLAY_STEP_BACK || playCommand == PLAY_STEP_FORWARD)
+    {
+      playTime = StepEyeCapture(&cap, playTime, (playCommand == PLAY_STEP_BACK) ? -1 : 1);
+      playPaused = true;
+    }
+    else if(playCommand == PLAY_BACK)
+      playTime = SeekEyeCapture(&cap, playTime - PLAY_JUMP);
+    else if(playCommand == PLAY_FORWARD)
+      playTime = SeekEyeCapture(&cap, playTime + PLAY_JUMP);
+    else if(playCommand == PLAY_RESTART)
+      playTime = SeekEyeCapture(&cap, 0);
+    else if(playCommand == PLAY_STOP)
+      viewState = STOP;
+    playCommand = PLAY_NONE;
+
     bzero(&currEye, sizeof(currEye));
-    currEye = *((EyeCap *) (import + (sizeof(EyeCap) * current)));
+    if(SampleEyeCapture(&cap, playTime, &currEye) != 0 && !playPaused)
+      viewState = STOP;
 
     Ex = currEye.Ex;
     Ey = currEye.Ey;
@@ -334,17 +401,12 @@ static void eyeCapViewer(double Epx, double Epy, double Epz, double Eox, double
     Uy = currEye.Uy;
     Uz = currEye.Uz;
 
-    current++;
-
-    //printf("Running. Frame: %lu.\n", current);
-
-    if(current == total_entries)
-      viewState = STOP;
+    //printf("Running. Time: %lf.\n", playTime);
   }
 
-  else if(viewState == STOP)
+  if(viewState == STOP)
   {
-    free(import);
+    UnmapEyeCapture(&cap);
 
     Ex = saveEye.Ex;
     Ey = saveEye.Ey;
@@ -363,69 +425,102 @@ static void eyeCapViewer(double Epx, double Epy, double Epz, double Eox, double
 }
 
 
-static void init_flag(void)
+//  Static scene element, placed once
+typedef struct
 {
-    for (int x=0; x<64; x++) {
-        for (int y=0; y<64; y++) {
-			flag[x][y][0] = (double) (x/3.0);
-			flag[x][y][1] = (double) (y/5.0);
-			flag[x][y][2] = (double) (sin((((x*45)/8.0)/360.0)*2.0*PI));
-		}
-	}
+  double tx, ty, tz;    //  Position
+  double sx, sy, sz;    //  Scale
+  double rx, ry, rz;    //  Rotation about x, y then z
+  double M[16];         //  Model matrix
+  double lo[3], hi[3];  //  Bounds in world coordinates
+} Placement;
+
+Placement flagpole = {-25, -5, -40, 1, 1, 1, 0, 0, 0};
+Placement screen = {-25, -14.7, -35, 4, 4, 1, 0, 0, 0};
+int flagpoleList, screenList;  //  Display lists of their fixed parts
+double frustum[6][4];          //  Clip planes of the current view in world coordinates
+
+// Work out the model matrix of an element and its bounds in the world from its local bounds
+static void place(Placement *p, double x0, double y0, double z0, double x1, double y1, double z1)
+{
+  int i, k;
+  glPushAttrib(GL_TRANSFORM_BIT);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glTranslated(p->tx, p->ty, p->tz);
+  glRotated(p->rx, 1, 0, 0);
+  glRotated(p->ry, 0, 1, 0);
+  glRotated(p->rz, 0, 0, 1);
+  glScaled(p->sx, p->sy, p->sz);
+  glGetDoublev(GL_MODELVIEW_MATRIX, p->M);
+  glPopMatrix();
+  glPopAttrib();
+  //  Box around the corners
+  for(k = 0; k < 8; k++)
+  {
+    double c[3] = {(k & 1) ? x1 : x0, (k & 2) ? y1 : y0, (k & 4) ? z1 : z0};
+    for(i = 0; i < 3; i++)
+    {
+      double w = p->M[i]*c[0] + p->M[4+i]*c[1] + p->M[8+i]*c[2] + p->M[12+i];
+      if(k == 0 || w < p->lo[i]) p->lo[i] = w;
+      if(k == 0 || w > p->hi[i]) p->hi[i] = w;
+    }
+  }
 }
 
-void draw_flag(double tx, double ty, double tz, double sx, double sy, double sz, double rx, double ry, double rz)
+// Clip planes from the projection and the camera, called once the camera is set
+static void set_frustum(void)
 {
-  unsigned int x, y;
-  double state;
-  static bool boolInit = true;
+  int i, j;
+  double P[16], M[16], C[16];
+  glGetDoublev(GL_PROJECTION_MATRIX, P);
+  glGetDoublev(GL_MODELVIEW_MATRIX, M);
+  for(i = 0; i < 4; i++)
+    for(j = 0; j < 4; j++)
+      C[4*i+j] = P[j]*M[4*i] + P[4+j]*M[4*i+1] + P[8+j]*M[4*i+2] + P[12+j]*M[4*i+3];
+  //  Sums and differences of the rows of projection x modelview
+  for(i = 0; i < 3; i++)
+    for(j = 0; j < 4; j++)
+    {
+      frustum[2*i][j]   = C[4*j+3] + C[4*j+i];
+      frustum[2*i+1][j] = C[4*j+3] - C[4*j+i];
+    }
+}
 
-  if(boolInit == true)
+// Whether any of an element's bounds are inside every clip plane
+static bool visible(const Placement *p)
+{
+  int i;
+  for(i = 0; i < 6; i++)
   {
-    init_flag();
-    boolInit = false;
+    const double *F = frustum[i];
+    if(F[0]*(F[0] > 0 ? p->hi[0] : p->lo[0]) + F[1]*(F[1] > 0 ? p->hi[1] : p->lo[1]) +
+       F[2]*(F[2] > 0 ? p->hi[2] : p->lo[2]) + F[3] < 0)
+      return false;
   }
+  return true;
+}
 
-  glPushMatrix();
-
-  glTranslated(tx, ty, tz);
-  glRotated(rx, 1, 0, 0);
-  glRotated(ry, 0, 1, 0);
-  glRotated(rz, 0, 0, 1);
-  glScaled(sx, sy, sz);
-
-  glBindTexture(GL_TEXTURE_2D, texture[3]);
-  draw_cylinder(-0.4, -2.25, 0, 0, 90, 0.8, 15, 8);
-  draw_sphere(-0.4, +12.8, 0, 0.8, 1, 0.8);
+void draw_flag(void)
+{
+  if(visible(&flagpole))
+  {
+    glPushMatrix();
 
-	glColor3f(1, 1, 1);
+    glMultMatrixd(flagpole.M);
+    glCallList(flagpoleList);
 
-  glBindTexture(GL_TEXTURE_2D, tex_flag);
-  glShadeModel(GL_SMOOTH);
+    glColor3f(1, 1, 1);
+    glBindTexture(GL_TEXTURE_2D, tex_flag);
+    glShadeModel(GL_SMOOTH);
+    DrawFlag();
 
-  for (x=0; x<63; x++)
-  {
-      for (y=0; y<63; y++)
-      {
-          glBegin(GL_QUADS);
-          GL_NORMAL(flag[x][y][0], flag[x][y][1], flag[x][y][2], flag[x+1][y][0], flag[x+1][y][1], flag[x+1][y][2], flag[x][y+1][0], flag[x][y+1][1], flag[x][y+1][2]);
-          glTexCoord2f(x/63.0, y/63.0);     glVertex3f(flag[x][y][0], flag[x][y][1], flag[x][y][2]);
-          glTexCoord2f(x/63.0, (y+1)/63.0);   glVertex3f(flag[x][y+1][0], flag[x][y+1][1], flag[x][y+1][2]);
-          glTexCoord2f((x+1)/63.0, (y+1)/63.0); glVertex3f(flag[x+1][y+1][0], flag[x+1][y+1][1], flag[x+1][y+1][2]);
-          glTexCoord2f((x+1)/63.0, y/63.0);   glVertex3f(flag[x+1][y][0], flag[x+1][y][1], flag[x+1][y][2]);
-          glEnd();
-      }
+    glPopMatrix();
   }
 
-  glPopMatrix();
-
-	for (y=0; y<64; y++)
-  {
-		state = flag[0][y][2];
-		for (x=0; x<63; x++)
-			flag[x][y][2] = flag[x+1][y][2];
-		flag[63][y][2] = state;
-	}
+  //  The flag waves whether it is seen or not, one column a frame
+  AdvanceFlag(1/3.0);
 }
 
 /*
@@ -471,53 +566,135 @@ void draw_overlay(int lTex, int rTex)
    glPopAttrib();
 }
 
+//  Mountain ranges drawn from the shared DEM mesh
+typedef struct
+{
+  Placement p;  //  Transform into the world before magnification
+  float dzmag;  //  Magnification added to zmag
+} Range;
+
+Range ranges[] =
+{
+  {{  0, -64, -40, 0.1250, 0.0625, 0.0625, 270, 0, 180}, +5},
+  {{ 40, -64,   0, 0.1250, 0.0625, 0.0625, 270, 0,  90}, -1},
+  {{  0, -64,  40, 0.1250, 0.0625, 0.0625, 270, 0,   0}, +2},
+  {{-40, -64,   0, 0.1250, 0.0625, 0.0625, 270, 0, 270}, -3},
+};
+#define NRANGES (int)(sizeof(ranges)/sizeof(ranges[0]))
+
 void ReadDEM(char* file)
 {
-   int i,j;
-   FILE* f = fopen(file,"r");
-   if (!f) Fatal("Cannot open file %s\n",file);
-   for (j=0;j<=64;j++)
-      for (i=0;i<=64;i++)
-      {
-         if (fscanf(f,"%f",&z[i][j])!=1) Fatal("Error reading saddleback.dem\n");
-         if (z[i][j] < zmin) zmin = z[i][j];
-         if (z[i][j] > zmax) zmax = z[i][j];
-      }
-   fclose(f);
+   int k;
+   double w,h,z0,dz;
+   if (MapHeightField(file,&dem)) Fatal("Cannot read heightfield %s (make builds it with dem2hf)\n",file);
+   mountains = LoadTerrain(&dem);
+   //  Place every range once around the magnified mesh (skirts hang at most the height range lower)
+   w = dem.dx*(dem.nx-1);
+   h = dem.dy*(dem.ny-1);
+   z0 = (dem.zmin+dem.zmax)/2;
+   dz = dem.zmax-dem.zmin;
+   for (k=0;k<NRANGES;k++)
+   {
+      double zm = zmag+ranges[k].dzmag;
+      place(&ranges[k].p,-w/2,-h/2,zm*(dem.zmin-z0-dz),w/2,h/2,zm*(dem.zmax-z0));
+   }
+}
+
+/*
+ *  Height of the ground at world x,z and its unit normal in n (when not NULL)
+ *    The highest mountain range there or else the streamed region (when its
+ *    tile there is loaded) or the floor of the sky cube
+ */
+double ground_height(double x, double z, double n[3])
+{
+  int k, i;
+  double y = -64, rz, rn[3];
+  double w = dem.dx*(dem.nx-1), h = dem.dy*(dem.ny-1);
+  if(n)
+  {
+    n[0] = n[2] = 0;
+    n[1] = 1;
+  }
+  //  Region placed as in draw_region, so its z axis is up and its y axis runs along -z
+  if(region && TerrainTilesHeight(x/REGION_SCALE, -z/REGION_SCALE, &rz, rn) == 0)
+  {
+    y = REGION_SCALE*rz - 64;
+    if(n)
+    {
+      n[0] = rn[0];
+      n[1] = rn[2];
+      n[2] = -rn[1];
+    }
+  }
+  for(k = 0; k < NRANGES; k++)
+  {
+    const double *M = ranges[k].p.M;
+    double zmag_local = zmag + ranges[k].dzmag;
+    //  The columns of M are the scaled terrain axes with up along the world y axis
+    double s[3], u, v, gy;
+    for(i = 0; i < 3; i++)
+      s[i] = M[4*i]*M[4*i] + M[4*i+1]*M[4*i+1] + M[4*i+2]*M[4*i+2];
+    u = (M[0]*(x-M[12]) + M[2]*(z-M[14]))/s[0];
+    v = (M[4]*(x-M[12]) + M[6]*(z-M[14]))/s[1];
+    if(fabs(u) > w/2 || fabs(v) > h/2)
+      continue;
+    gy = M[13] + M[1]*u + M[5]*v + M[9]*zmag_local*(HeightFieldHeight(&dem, u+w/2, v+h/2) - (dem.zmin+dem.zmax)/2);
+    if(gy <= y)
+      continue;
+    y = gy;
+    if(n)
+    {
+      //  Normals go through the inverse transpose, which divides each column by its squared length
+      double t[3], len;
+      HeightFieldNormal(&dem, u+w/2, v+h/2, t);
+      t[2] /= zmag_local;
+      for(i = 0; i < 3; i++)
+        n[i] = M[i]*t[0]/s[0] + M[4+i]*t[1]/s[1] + M[8+i]*t[2]/s[2];
+      len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      for(i = 0; i < 3; i++)
+        n[i] /= len;
+    }
+  }
+  return y;
 }
 
+// Draw the mountain ranges in view, which share their color, texture and mesh
+void draw_mountains(void)
+{
+  int k;
+  glColor3f(1,1,1);
+  glBindTexture(GL_TEXTURE_2D,texture[2]);
+  glShadeModel(smooth ? GL_SMOOTH : GL_FLAT);
+
+  for(k = 0; k < NRANGES; k++)
+    if(visible(&ranges[k].p))
+    {
+      glPushMatrix();
+      glMultMatrixd(ranges[k].p.M);
+      //  Only the magnification differs
+      glScaled(1, 1, zmag + ranges[k].dzmag);
+      terrainTris += DrawTerrain(mountains);
+      glPopMatrix();
+    }
+}
 
-void draw_mountains(double tx, double ty, double tz, double sx, double sy, double sz, double rx, double ry, double rz, float zmag_local)
+/*
+ *  Draw the streamed region as the ground
+ */
+void draw_region(void)
 {
-   int i,j;
-   double z0 = (zmin+zmax)/2;
+  //  Tiles around the eye (the y axis of the region runs along -z)
+  UpdateTerrainTiles(Ex/REGION_SCALE, -Ez/REGION_SCALE, REGION_RADIUS/REGION_SCALE);
 
   glPushMatrix();
-
-  glTranslated(tx, ty, tz);
-  glRotated(rx, 1, 0, 0);
-  glRotated(ry, 0, 1, 0);
-  glRotated(rz, 0, 0, 1);
-  glScaled(sx, sy, sz);
+  glTranslated(0, -64, 0);
+  glRotated(270, 1, 0, 0);
+  glScaled(REGION_SCALE, REGION_SCALE, REGION_SCALE);
 
   glColor3f(1,1,1);
-  glBindTexture(GL_TEXTURE_2D,texture[2]);
   glShadeModel(smooth ? GL_SMOOTH : GL_FLAT);
 
-  for (i=0;i<64;i++)
-     for (j=0;j<64;j++)
-     {
-        float x=16*i-512;
-        float y=16*j-512;
-        glBegin(GL_QUADS);
-
-        GL_NORMAL(x+ 0,y+ 0,zmag_local*(z[i+0][j+0]-z0), x+16,y+ 0,zmag_local*(z[i+1][j+0]-z0), x+ 0,y+16,zmag_local*(z[i+0][j+1]-z0));
-        glTexCoord2f((i+0)/64.,(j+0)/64.); glVertex3d(x+ 0,y+ 0,zmag_local*(z[i+0][j+0]-z0));
-        glTexCoord2f((i+1)/64.,(j+0)/64.); glVertex3d(x+16,y+ 0,zmag_local*(z[i+1][j+0]-z0));
-        glTexCoord2f((i+1)/64.,(j+1)/64.); glVertex3d(x+16,y+16,zmag_local*(z[i+1][j+1]-z0));
-        glTexCoord2f((i+0)/64.,(j+1)/64.); glVertex3d(x+ 0,y+16,zmag_local*(z[i+0][j+1]-z0));
-        glEnd();
-     }
+  terrainTris += DrawTerrainTiles();
   glPopMatrix();
 }
 
@@ -990,56 +1167,27 @@ static void DrawFlight(double x0,double y0,double z0,
 }
 
 
-static void init_pb_screen(unsigned int *tex_list, const char * path, unsigned int count)
-{
-  unsigned int current = 0;
-  unsigned int path_length = strlen(path);
-  char full_path[path_length+10];
-
-  for(current = 0; current < count; current++)
-  {
-    sprintf(full_path, "%s-%u.bmp", path, current + 1);
-    *(tex_list + current) = LoadTexBMP(full_path);
-  }
-}
-
 /*
  *  Generates a polygon screen and plays multiple frames on it.
  */
-static void draw_playback_screen(double tx, double ty, double tz,
-                            double s,
-                            double rx, double ry, double rz,
-                            const char * path, unsigned int count)
+static void draw_playback_screen(const char * clip)
 {
-  static unsigned int current = 0;
-  static bool init = true;
-  static unsigned int *tex_pb_screen;
-
+  static int video = 0;
 
-  if(init == true)
-  {
-    tex_pb_screen = (unsigned int *) malloc(sizeof(unsigned int) * count);
-    init_pb_screen(tex_pb_screen, path, count);
-    init = false;
-  }
+  //  Frames are streamed from the clip into one texture at the clip's own rate
+  //  but only while the screen is in view
+  if(video == 0)
+    video = OpenVideo(clip, PB_FPS);
+  if(!visible(&screen))
+    return;
+  UpdateVideo(video, game_clock());
 
   glPushMatrix();
-  glTranslated(tx, ty, tz);
-  glRotated(ry, 0, 1, 0);
-  glRotated(rz, 0, 0, 1);
-  glRotated(rx, 1, 0, 0);
-  glScaled(s, s, 1);
-
-  glBindTexture(GL_TEXTURE_2D, texture[3]);
-  draw_cylinder(-2.0625, -1.5, 0, 0, 90, 0.0625, 2.5, 8);
-  draw_cylinder(+2.0625, -1.5, 0, 0, 90, 0.0625, 2.5, 8);
-  draw_cylinder(0, +1.0625 , 0, 90, 0, 0.0625, 2, 8);
-  draw_cylinder(0, -1.0625 , 0, 90, 0, 0.0625, 2, 8);
-  draw_sphere(-2.0625, 1, 0, 0.0625, 0.25, 0.0625);
-  draw_sphere(+2.0625, 1, 0, 0.0625, 0.25, 0.0625);
+  glMultMatrixd(screen.M);
+  glCallList(screenList);
 
 
-  glBindTexture(GL_TEXTURE_2D, *(tex_pb_screen + current));
+  glBindTexture(GL_TEXTURE_2D, VideoTexture(video));
   glBegin(GL_QUADS);
   //  Front
   glNormal3f( 0, 0, +1);
@@ -1050,62 +1198,128 @@ static void draw_playback_screen(double tx, double ty, double tz,
   glEnd();
 
   glPopMatrix();
-
-  current++;
-  if(current == count)
-    current = 0;
 }
 
-static void refreshViewMenu(void)
+/*
+ *  Place the flagpole and the frame of the playback screen and record their fixed geometry
+ */
+static void init_statics(void)
 {
-  DIR *dir;
-  unsigned int current = 0;
-	struct dirent *ent;
+  place(&flagpole, -1.2, -17.25, -1, 21, 13.8, 1);
+  flagpoleList = glGenLists(1);
+  glNewList(flagpoleList, GL_COMPILE);
+  glBindTexture(GL_TEXTURE_2D, texture[3]);
+  draw_cylinder(-0.4, -2.25, 0, 0, 90, 0.8, 15, 8);
+  draw_sphere(-0.4, +12.8, 0, 0.8, 1, 0.8);
+  glEndList();
+  //  64 by 64 samples a third and a fifth apart with one wave across
+  InitFlag(64, 64, 21, 12.6, 1, 64/3.0);
 
-  if(viewMenuFileEntries != 0)
-  {
-    free(filenameList);
+  place(&screen, -2.125, -1.125, -0.0625, 2.125, 1.25, 0.0625);
+  screenList = glGenLists(1);
+  glNewList(screenList, GL_COMPILE);
+  glBindTexture(GL_TEXTURE_2D, texture[3]);
+  draw_cylinder(-2.0625, -1.5, 0, 0, 90, 0.0625, 2.5, 8);
+  draw_cylinder(+2.0625, -1.5, 0, 0, 90, 0.0625, 2.5, 8);
+  draw_cylinder(0, +1.0625 , 0, 90, 0, 0.0625, 2, 8);
+  draw_cylinder(0, -1.0625 , 0, 90, 0, 0.0625, 2, 8);
+  draw_sphere(-2.0625, 1, 0, 0.0625, 0.25, 0.0625);
+  draw_sphere(+2.0625, 1, 0, 0.0625, 0.25, 0.0625);
+  glEndList();
+}
 
-    glutSetMenu(viewMenu);
-    for(current = 2; current < (viewMenuFileEntries + 2); current++)
-      glutRemoveMenuItem(2);
-  }
+// Any change to the capture directory can move captures between pages
+//   The menus are only marked here and rebuilt once they are closed
+static void view_menu_changed(const CapEntry *entry, int change)
+{
+  boolViewMenuChanged = true;
+}
 
-  viewMenuFileEntries = 0;
+// Add a menu entry with a label built from a format
+static void add_menu_entry(int value, const char *format, ...)
+{
+  va_list args;
+  char *label;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if((label = malloc(len + 1)) == NULL)
+    Fatal("Cannot allocate memory for capture menu\n");
+  va_start(args, format);
+  vsprintf(label, format, args);
+  va_end(args);
+  glutAddMenuEntry(label, value);
+  free(label);
+}
 
-	if((dir = opendir("capture/")) != NULL)
-	{
-  	while((ent = readdir(dir)) != NULL)
-		{
-      if((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
-          viewMenuFileEntries++;
-		}
-    closedir(dir);
-  }
+// Rebuild the current page of the view menu and the dates to jump to
+//   Only VIEW_PAGE captures are listed however many there are, grouped under the day they were made
+static void build_view_menu(void)
+{
+  const CapEntry *entry;
+  const CapDay *days;
+  int k, d = 0, date = 0, count = CaptureDirCount(), ndays = CaptureDirDays(&days);
 
-  filenameList = (char *) malloc(sizeof(char) * viewMenuFileEntries * MAX_FILENAME_LENGTH);
-  bzero(filenameList, sizeof(char) * viewMenuFileEntries * MAX_FILENAME_LENGTH);
-  current = 0;
+  if(viewFirst >= count)
+    viewFirst = (count > 0) ? (count - 1) / VIEW_PAGE * VIEW_PAGE : 0;
 
-  if((dir = opendir("capture/")) != NULL)
+  glutSetMenu(viewMenu);
+  for(; viewMenuItems > 0; viewMenuItems--)
+    glutRemoveMenuItem(4 + viewMenuItems);
+  add_menu_entry(VIEW_NONE, "Captures %d-%d of %d", count ? viewFirst + 1 : 0, (viewFirst + VIEW_PAGE < count) ? viewFirst + VIEW_PAGE : count, count);
+  viewMenuItems++;
+  for(k = viewFirst; k < viewFirst + VIEW_PAGE && (entry = CaptureDirNewest(k)) != NULL; k++)
   {
-    while((ent = readdir(dir)) != NULL)
+    // Heading for each day on the page
+    while(d + 1 < ndays && days[d + 1].first <= k)
+      d++;
+    if(days[d].date != date)
     {
-      if((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
-      {
-          sprintf(filenameList + (MAX_FILENAME_LENGTH * current), "%s", ent->d_name);
-          current++;
-      }
+      date = days[d].date;
+      add_menu_entry(VIEW_NONE, "-- %04d-%02d-%02d --", date / 10000, date / 100 % 100, date % 100);
+      viewMenuItems++;
     }
-    closedir(dir);
+    add_menu_entry(entry->id + VIEW_FILE, "%s (%.0fs, %.0f x %.0f x %.0f)", entry->name, entry->duration,
+                   entry->hi[0] - entry->lo[0], entry->hi[1] - entry->lo[1], entry->hi[2] - entry->lo[2]);
+    viewMenuItems++;
   }
 
-  glutSetMenu(viewMenu);
-  for(current = 2; current < (viewMenuFileEntries + 2); current++)
-    glutAddMenuEntry(filenameList + (MAX_FILENAME_LENGTH * (current - 2)), current);
-
+  // Days, or months once there are too many days to list
+  glutSetMenu(dateMenu);
+  for(; dateMenuItems > 0; dateMenuItems--)
+    glutRemoveMenuItem(dateMenuItems);
+  for(k = 0; k < ndays; )
+  {
+    int group = (ndays > VIEW_PAGE) ? days[k].date / 100 : days[k].date;
+    int first = days[k].first, n = 0;
+    for(; k < ndays && ((ndays > VIEW_PAGE) ? days[k].date / 100 : days[k].date) == group; k++)
+      n += days[k].count;
+    if(ndays > VIEW_PAGE)
+      add_menu_entry(first, "%04d-%02d (%d)", group / 100, group % 100, n);
+    else
+      add_menu_entry(first, "%04d-%02d-%02d (%d)", group / 10000, group / 100 % 100, group % 100, n);
+    dateMenuItems++;
+  }
 
   glutSetMenu(mainMenu);
+  boolViewMenuChanged = false;
+}
+
+static void refreshViewMenu(void)
+{
+  static bool watching = false;
+
+  // The first time reads the saved index, later only what changed
+  if(!watching)
+  {
+    OpenCaptureDir("capture");
+    watching = true;
+  }
+  else
+    RescanCaptureDir(view_menu_changed);
+  boolViewMenuChanged = true;
 }
 
 static void draw_obj(double tx, double ty, double tz, double sx, double sy, double sz, double rx, double ry, double rz)
@@ -1119,7 +1333,7 @@ static void draw_obj(double tx, double ty, double tz, double sx, double sy, doub
   glScaled(sx, sy, sz);
 
   glBindTexture(GL_TEXTURE_2D, tex_flag);
-  glCallList(lm);
+  DrawOBJ(lm);
 
   glPopMatrix();
 }
@@ -1163,6 +1377,29 @@ static void updateLocation(Location *object)
     object->z += 0;
 }
 
+/*
+ *  Move an object standing on the ground to a new location
+ *    It stays on the ground and cannot climb slopes steeper than MAX_SLOPE
+ */
+static void walk_on_ground(Location *object, Location to)
+{
+  double n[3];
+  double y = ground_height(to.x, to.z, n) + ASTRONAUT_FEET;
+  if(to.y < y)
+  {
+    //  Too steep to climb, so only the height changes
+    if(n[1] < Cos(MAX_SLOPE) && y > object->y)
+    {
+      to.x = object->x;
+      to.z = object->z;
+      y = ground_height(to.x, to.z, NULL) + ASTRONAUT_FEET;
+    }
+    if(to.y < y)
+      to.y = y;
+  }
+  *object = to;
+}
+
 static bool collisionDetect(Location a, Location b, double distance)
 {
   double measured = 0;
@@ -1184,12 +1421,15 @@ void display()
 {
    const double len = 10;  //  Length of axes
    static unsigned int SpinAngle = 0;
+   Location walk;
    //  Erase the window and the depth buffer
    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
    //  Enable Z-buffering in OpenGL
    glEnable(GL_DEPTH_TEST);
    //  Undo previous transformations
    glLoadIdentity();
+   //  Replace placeholders with textures decoded in the background
+   UploadTextures(TEX_UPLOAD_BUDGET);
 
    // if((capState == RUNNING) || (capState == STOP))
    //  printf("DP: %lf %lf %lf %lf %lf %lf %lf %lf %lf.\n", Ex, Ey, Ez, Ox, Oy, Oz, Ux, Uy, Uz);
@@ -1197,12 +1437,24 @@ void display()
    eyeCapture(Ex,Ey,Ez , Ox,Oy,Oz , Ux,Uy,Uz);
    eyeCapViewer(Ex,Ey,Ez , Ox,Oy,Oz , Ux,Uy,Uz);
    gluLookAt(Ex,Ey,Ez , Ox,Oy,Oz , Ux,Uy,Uz);
+   //  Static elements outside the view are skipped
+   set_frustum();
 
    if(boolRefreshViewMenu == true)
    {
      refreshViewMenu();
      boolRefreshViewMenu = false;
    }
+   //  New, finished and deleted captures, shown once the menu is closed
+   PollCaptureDir(view_menu_changed);
+   if(boolViewMenuChanged == true && menuInUse == false)
+     build_view_menu();
+   if(boolCaptureMenuChanged == true && menuInUse == false)
+   {
+     glutSetMenu(mainMenu);
+     glutChangeToMenuEntry(1, (capState == RUNNING) ? "Stop Capture" : "Start Capture", 1);
+     boolCaptureMenuChanged = false;
+   }
 
    glEnable(GL_TEXTURE_2D);
    glTexEnvi(GL_TEXTURE_ENV , GL_TEXTURE_ENV_MODE , GL_MODULATE);
@@ -1262,17 +1514,19 @@ void display()
   if(fly)
    DrawFlight(X,Y,Z , Dx,Dy,Dz , Ux,Uy,Uz);
 
-  draw_flag(-25, -5, -40, 1, 1, 1, 0, 0, 0);
+  draw_flag();
 
   if(show_pb_screen)
-    draw_playback_screen(-25, -14.7, -35, 4, 0, 0, 0, "textures/playback/playback", 132);
+    draw_playback_screen("textures/playback.clip");
 
-   draw_mountains(0, -64, -40, 0.1250, 0.0625, 0.0625, 270, 0, 180, zmag + 5);
-   draw_mountains(40, -64, 0, 0.1250, 0.0625, 0.0625, 270, 0, 90, zmag - 1);
-   draw_mountains(0, -64, 40, 0.1250, 0.0625, 0.0625, 270, 0, 0, zmag + 2);
-   draw_mountains(-40, -64, 0, 0.1250, 0.0625, 0.0625, 270, 0, 270, zmag - 3);
+   terrainTris = 0;
+   draw_mountains();
+   if(region)
+     draw_region();
 
-  updateLocation(&astronaut);
+  walk = astronaut;
+  updateLocation(&walk);
+  walk_on_ground(&astronaut, walk);
   draw_obj(astronaut.x , astronaut.y ,astronaut.z, 10,10,10, 0, SpinAngle, 0);
 
   if(boolCollisionDetected == false)
@@ -1334,7 +1588,16 @@ void display()
      glWindowPos2i(5, 25);
      Print("X = %lf   Y = %lf   Z = %lf   Ex = %lf   Ey = %lf   Ez = %lf   Yaw = %lf   Pitch = %lf   Roll = %lf", X, Y, Z, Ex, Ey, Ez, yaw, pitch, roll);
      glWindowPos2i(5, 5);
-     Print("Capture: %s", (capState == RUNNING)?"ON":"OFF");
+     Print("Capture: %s   Rate: %s   Playback: x%g   Terrain: %gpx %d tris", (capState == RUNNING)?"ON":"OFF", rateName(capRate), playSpeed, terrainError, terrainTris);
+     if(viewState == RUNNING)
+       Print("   %.1f / %.1f s%s", playTime, playLength, playPaused ? "   Paused" : "");
+     if(region)
+     {
+       int resident, loading;
+       long long held;
+       TerrainTilesInfo(&resident, &loading, &held);
+       Print("   Region: %d tiles %.1fMB %d loading", resident, held/1048576.0, loading);
+     }
    }
 
    //  Render the scene and make it visible
@@ -1348,8 +1611,8 @@ void display()
     show_overlay = false;
 
     astronaut.x = 0;
-    astronaut.y = -40;
     astronaut.z = 0;
+    astronaut.y = ground_height(astronaut.x, astronaut.z, NULL) + ASTRONAUT_FEET;
 
     Ex = -0.0;
     Ey = 0.0;
@@ -1488,8 +1751,8 @@ void timer(int toggle)
       }
    }
    //  Set timer to go again
-   if (move && toggle >= 0)
-    glutTimerFunc(50, timer, 0);
+   if (move && toggle >= 0 && !replaying)
+    glutTimerFunc(50, on_timer, 0);
 
    //  Tell GLUT it is necessary to redisplay the scene
    glutPostRedisplay();
@@ -1710,6 +1973,24 @@ void key(unsigned char ch,int x,int y)
     else if (ch == '8' || (ch == 't'))
       translate = translatePOS;
 
+    //  Capture playback controls
+    else if (ch == ' ')
+        playCommand = PLAY_PAUSE;
+    else if (ch == '(')
+        playCommand = PLAY_BACK;
+    else if (ch == ')')
+        playCommand = PLAY_FORWARD;
+    else if (ch == ',' && playSpeed > 0.125)
+        playSpeed /= 2;
+    else if (ch == '.' && playSpeed < 8)
+        playSpeed *= 2;
+
+    //  Terrain detail
+    else if (ch == 'h' && terrainError > 0.25)
+        TerrainError(terrainError /= 2);
+    else if (ch == 'H' && terrainError < 64)
+        TerrainError(terrainError *= 2);
+
     else if (ch == 'j')
         temp -= 0.1;
     else if (ch == 'k')
@@ -1802,42 +2083,257 @@ void mainMenuHandler(int value)
 
 void viewMenuHandler(int value)
 {
-  if(value == 1)
+  if(value == VIEW_REFRESH)
     boolRefreshViewMenu = true;
 
-  if(value > 1)
+  else if(value == VIEW_NEWER && viewFirst > 0)
+  {
+    viewFirst = (viewFirst > VIEW_PAGE) ? viewFirst - VIEW_PAGE : 0;
+    boolViewMenuChanged = true;
+  }
+
+  else if(value == VIEW_OLDER && viewFirst + VIEW_PAGE < CaptureDirCount())
+  {
+    viewFirst += VIEW_PAGE;
+    boolViewMenuChanged = true;
+  }
+
+  else if(value >= VIEW_FILE)
   {
     //printf("Hello\n");
-    viewFileIndex = value;
+    viewFileId = value - VIEW_FILE;
 
     if((viewState == IDLE) && (capState == IDLE))
       viewState = INIT;
   }
 }
 
-static void glutMenuSetup(void)
+// Jump to the page starting with the newest capture of a day or month
+void dateMenuHandler(int value)
 {
-  viewMenu = glutCreateMenu(viewMenuHandler);
-    glutAddMenuEntry("Refresh", 1);
+  viewFirst = value;
+  boolViewMenuChanged = true;
+}
 
-  mainMenu = glutCreateMenu(mainMenuHandler);
-    glutAddMenuEntry("Start Capture", 1);
-    glutAddSubMenu ("Viewer", viewMenu);
-    glutAddMenuEntry("Exit", 3);
-  glutAttachMenu(GLUT_RIGHT_BUTTON);
+void rateMenuHandler(int value)
+{
+  capRate = value;
+}
+
+void playMenuHandler(int value)
+{
+  if(viewState == RUNNING)
+    playCommand = value;
 }
 
 /*
- *  Start up GLUT and tell it what to do
+ *  GLUT callbacks go through these so every input and timer tick is
+ *  journaled in the order it happened when recording
  */
-int main(int argc, char* argv[])
+void on_display(void)
+{
+  WriteJournal(frameTick, J_FRAME, glutGet(GLUT_ELAPSED_TIME), 0, 0, 0);
+  display();
+  frameTick++;
+}
+
+void on_key(unsigned char ch, int x, int y)
+{
+  WriteJournal(frameTick, J_KEY, ch, x, y, 0);
+  key(ch, x, y);
+}
+
+void on_special(int k, int x, int y)
+{
+  WriteJournal(frameTick, J_SPECIAL, k, x, y, 0);
+  special(k, x, y);
+}
+
+void on_mouse(int button, int state, int x, int y)
+{
+  WriteJournal(frameTick, J_MOUSE, button, state, x, y);
+  mouse(button, state, x, y);
+}
+
+void on_timer(int value)
+{
+  WriteJournal(frameTick, J_TIMER, value, 0, 0, 0);
+  timer(value);
+}
+
+void on_reshape(int width, int height)
+{
+  WriteJournal(frameTick, J_RESHAPE, width, height, 0, 0);
+  reshape(width, height);
+}
+
+//  Menus are numbered in the journal in this order
+static void (*menuHandlers[])(int) = {mainMenuHandler, viewMenuHandler, rateMenuHandler, playMenuHandler, dateMenuHandler};
+
+static void on_menu(int menu, int value)
+{
+  WriteJournal(frameTick, J_MENU, value, 0, 0, menu);
+  menuHandlers[menu](value);
+}
+
+void on_main_menu(int value) {on_menu(0, value);}
+void on_view_menu(int value) {on_menu(1, value);}
+void on_rate_menu(int value) {on_menu(2, value);}
+void on_play_menu(int value) {on_menu(3, value);}
+void on_date_menu(int value) {on_menu(4, value);}
+
+// Menus cannot be changed while they are shown
+void menu_status(int status, int x, int y)
+{
+  menuInUse = (status == GLUT_MENU_IN_USE);
+}
+
+/*
+ *  Scene state and assets, once there is an OpenGL context
+ */
+void init_scene(void)
 {
     show_sky = true;
     show_overlay = false;
     show_pb_screen = true;
+
+    //  Load textures in the background
+    texture[0] = LoadTexBMPAsync("textures/trunk.bmp", 0);
+    texture[1] = LoadTexBMPAsync("textures/wings.bmp", 0);
+    texture[2] = LoadTexBMPAsync("textures/rockies.bmp", 1);
+    texture[3] = LoadTexBMPAsync("textures/metal.bmp", 0);
+
+    //  Load skybox texture
+    tex_skycube[0] = LoadTexBMPAsync("textures/skycube_sides.bmp", 1);
+    tex_skycube[1] = LoadTexBMPAsync("textures/skycube_topbottom.bmp", 1);
+
+    tex_cd = LoadTexBMPAsync("textures/cd.bmp", 0);
+    tex_ma = LoadTexBMPAsync("textures/ma.bmp", 0);
+    tex_pa = LoadTexBMPAsync("textures/pa.bmp", 0);
+    tex_ufo[0] = LoadTexBMPAsync("textures/ufo1.bmp", 0);
+    tex_ufo[1] = LoadTexBMPAsync("textures/ufo2.bmp", 0);
+
+    tex_flag = LoadTexBMPAsync("textures/us.bmp", 0);
+
+    lm = LoadOBJ("obj/astronaut.obj");
+
+    //  Load DEM
+    ReadDEM("textures/mountain.hf");
+    init_statics();
+
+    //  Astronaut starts standing on the ground
     astronaut.x = 0;
-    astronaut.y = -40;
     astronaut.z = 0;
+    astronaut.y = ground_height(astronaut.x, astronaut.z, NULL) + ASTRONAUT_FEET;
+}
+
+//  The benchmark build supplies its own main (bench.c)
+#ifndef BENCH
+static void glutMenuSetup(void)
+{
+  int rateMenu, playMenu;
+
+  dateMenu = glutCreateMenu(on_date_menu);
+
+  viewMenu = glutCreateMenu(on_view_menu);
+    glutAddMenuEntry("Refresh", VIEW_REFRESH);
+    glutAddSubMenu ("By Date", dateMenu);
+    glutAddMenuEntry("Newer", VIEW_NEWER);
+    glutAddMenuEntry("Older", VIEW_OLDER);
+
+  rateMenu = glutCreateMenu(on_rate_menu);
+    glutAddMenuEntry("Every Frame", 0);
+    glutAddMenuEntry("60 Hz", 60);
+    glutAddMenuEntry("30 Hz", 30);
+    glutAddMenuEntry("10 Hz", 10);
+
+  playMenu = glutCreateMenu(on_play_menu);
+    glutAddMenuEntry("Play/Pause", PLAY_PAUSE);
+    glutAddMenuEntry("Step Back", PLAY_STEP_BACK);
+    glutAddMenuEntry("Step Forward", PLAY_STEP_FORWARD);
+    glutAddMenuEntry("Back 5s", PLAY_BACK);
+    glutAddMenuEntry("Forward 5s", PLAY_FORWARD);
+    glutAddMenuEntry("Restart", PLAY_RESTART);
+    glutAddMenuEntry("Stop", PLAY_STOP);
+
+  mainMenu = glutCreateMenu(on_main_menu);
+    glutAddMenuEntry("Start Capture", 1);
+    glutAddSubMenu ("Viewer", viewMenu);
+    glutAddSubMenu ("Playback", playMenu);
+    glutAddSubMenu ("Capture Rate", rateMenu);
+    glutAddMenuEntry("Exit", 3);
+  //  A replay takes its menu choices from the journal
+  if(!replaying)
+  {
+    glutMenuStatusFunc(menu_status);
+    glutAttachMenu(GLUT_RIGHT_BUTTON);
+  }
+}
+
+/*
+ *  Replay the events up to and including the next frame
+ *    Runs as the idle function so frames are drawn as fast as possible
+ */
+static void replay_idle(void)
+{
+  while(replayNext < replay.n)
+  {
+    const JournalEvent *ev = replay.ev + replayNext++;
+
+    if(ev->tick != frameTick)
+      fprintf(stderr, "Journal event %lld is for frame %d but this is frame %d\n", replayNext - 1, ev->tick, frameTick);
+
+    if(ev->type == J_FRAME)
+    {
+      replayClock = ev->a / 1000.0;
+      display();
+      frameTick++;
+      return;
+    }
+    else if(ev->type == J_KEY)
+      key(ev->a, ev->b, ev->c);
+    else if(ev->type == J_SPECIAL)
+      special(ev->a, ev->b, ev->c);
+    else if(ev->type == J_MOUSE)
+      mouse(ev->a, ev->b, ev->c, ev->d);
+    else if(ev->type == J_TIMER)
+      timer(ev->a);
+    else if(ev->type == J_RESHAPE)
+      reshape(ev->a, ev->b);
+    else if(ev->type == J_MENU && ev->d >= 0 && ev->d < (int)(sizeof menuHandlers / sizeof *menuHandlers))
+      menuHandlers[ev->d](ev->a);
+  }
+  exit(0);
+}
+
+// Replay summary, also when the journal ends by exiting the game
+static void replay_report(void)
+{
+  static struct timespec start;
+  struct timespec now;
+
+  if(start.tv_sec == 0 && start.tv_nsec == 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  printf("Replayed %d frames (%.1f s of play) in %.3f s\n", frameTick, replayClock,
+         (now.tv_sec - start.tv_sec) + 1e-9 * (now.tv_nsec - start.tv_nsec));
+}
+
+// Redraws requested by GLUT do not advance a replay
+static void replay_display(void)
+{
+}
+
+/*
+ *  Start up GLUT and tell it what to do
+ */
+int main(int argc, char* argv[])
+{
+    const char *record = NULL, *journal = NULL, *tiles = NULL;
+    int k;
 
     //  Initialize GLUT
     glutInit(&argc, argv);
@@ -1847,39 +2343,62 @@ int main(int argc, char* argv[])
     glutCreateWindow("Sandeep Raj Kumbargeri - The Moon Astronaut");
     //glutFullScreen();
 
-    //  Set callbacks
-    glutDisplayFunc(display);
-    glutReshapeFunc(reshape);
-    glutSpecialFunc(special);
-    glutKeyboardFunc(key);
-    glutMouseFunc(mouse);
-    //glutPassiveMotionFunc(motion);
-    glutMenuSetup();
-
-    //  Load textures
-    texture[0] = LoadTexBMP("textures/trunk.bmp");
-    texture[1] = LoadTexBMP("textures/wings.bmp");
-    texture[2] = LoadTexBMP("textures/rockies.bmp");
-    texture[3] = LoadTexBMP("textures/metal.bmp");
-
-    //  Load skybox texture
-    tex_skycube[0] = LoadTexBMP("textures/skycube_sides.bmp");
-    tex_skycube[1] = LoadTexBMP("textures/skycube_topbottom.bmp");
-
-    tex_cd = LoadTexBMP("textures/cd.bmp");
-    tex_ma = LoadTexBMP("textures/ma.bmp");
-    tex_pa = LoadTexBMP("textures/pa.bmp");
-    tex_ufo[0] = LoadTexBMP("textures/ufo1.bmp");
-    tex_ufo[1] = LoadTexBMP("textures/ufo2.bmp");
-
-    tex_flag = LoadTexBMP("textures/us.bmp");
+    //  Record the session with --record <journal> or replay one with --replay <journal>
+    //  Stream the ground from a tile store with --region <tiles>
+    for(k = 1; k < argc; k += 2)
+    {
+      if(k+1 < argc && strcmp(argv[k], "--record") == 0 && !journal)
+        record = argv[k+1];
+      else if(k+1 < argc && strcmp(argv[k], "--replay") == 0 && !record)
+        journal = argv[k+1];
+      else if(k+1 < argc && strcmp(argv[k], "--region") == 0)
+        tiles = argv[k+1];
+      else
+        Fatal("Usage: %s [--record <journal> | --replay <journal>] [--region <tiles>]\n", argv[0]);
+    }
+    if(tiles)
+    {
+      if(OpenTerrainTiles(tiles, REGION_BUDGET) != 0)
+        Fatal("Cannot read terrain tiles %s (make builds textures/mountain.tiles with mktiles)\n", tiles);
+      region = true;
+    }
 
-    lm = LoadOBJ("obj/astronaut.obj");
+    if(journal)
+    {
+      if(MapJournal(journal, &replay) != 0)
+        Fatal("Cannot read journal %s\n", journal);
+      replaying = true;
+      //  Input comes from the journal and frames are drawn as fast as possible
+      glutDisplayFunc(replay_display);
+      glutIdleFunc(replay_idle);
+    }
+    else
+    {
+      if(record && OpenJournal(record) != 0)
+        Fatal("Cannot create journal %s\n", record);
+      //  Set callbacks
+      glutDisplayFunc(on_display);
+      glutReshapeFunc(on_reshape);
+      glutSpecialFunc(on_special);
+      glutKeyboardFunc(on_key);
+      glutMouseFunc(on_mouse);
+      //glutPassiveMotionFunc(motion);
+    }
+    glutMenuSetup();
 
-    //  Load DEM
-    ReadDEM("textures/mountain.drp");
+    init_scene();
 
-    timer(1);
+    if(journal)
+    {
+      //  Every texture in place and every video frame on time so replays draw the same frames
+      FinishTextures();
+      SyncVideo(1);
+      replay_report();
+      atexit(replay_report);
+    }
+    //  The first tick starts the 50ms timer
+    else
+      on_timer(1);
 
     //glutIdleFunc(idle);
 
@@ -1887,3 +2406,4 @@ int main(int argc, char* argv[])
     glutMainLoop();
     return 0;
 }
+#endif
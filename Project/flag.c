@@ -0,0 +1,223 @@
+/*
+ *  Waving flag
+ *
+ *  The flag is a grid of nx by ny samples lying in the x-y plane from the
+ *  origin with a sine wave running along x.  Nothing is simulated: the
+ *  height and normal of every column follow from how far the wave has
+ *  travelled, so AdvanceFlag only adds to a phase and costs the same whether
+ *  or not the flag is drawn.
+ *
+ *  Every sample in a column has the same height and normal, so DrawFlag
+ *  works out one column at a time from the sine and cosine of the column at
+ *  rest rotated by the phase.  The columns are kept as separate arrays of
+ *  each quantity so that GCC and clang can do four at once with vector
+ *  extensions; other compilers get a plain loop.  The grid is then written
+ *  straight into a vertex buffer that is orphaned every frame, and drawn as
+ *  one indexed triangle strip with degenerate triangles joining the rows.
+ *  Texture coordinates and indexes never change and live in buffers of
+ *  their own.
+ */
+#include "CSCIx229.h"
+#include "flag.h"
+#include <stdint.h>
+
+//  Four floats handled at once
+#if defined(__GNUC__)
+typedef float v4sf __attribute__((vector_size(16)));
+#else
+typedef struct {float f[4];} v4sf;
+#endif
+
+static int    Nx=0,Ny=0;   //  Samples across and up
+static int    Ncol=0;      //  Columns rounded up to whole vectors
+static float  A=0,K=0;     //  Amplitude and wave number
+static double Wave=1;      //  Wavelength
+static double Phase=0;     //  Distance the wave has travelled (within one wavelength)
+static float* Y=NULL;      //  Height of each row
+static v4sf*  X=NULL;      //  Position of each column
+static v4sf*  S=NULL;      //  Sine of each column at rest
+static v4sf*  C=NULL;      //  Cosine of each column at rest
+static v4sf*  Z=NULL;      //  Displacement of each column now
+static v4sf*  N=NULL;      //  Slope of each column now
+static float* V=NULL;      //  Vertexes when the buffer cannot be mapped
+static unsigned int vbo=0,tbo=0,ibo=0;
+static int    Nindex=0;
+
+/*
+ *  Set up the flag
+ *    Samples are spread evenly over width by height
+ *    The wave moves amplitude either side of the plane
+ */
+void InitFlag(int nx,int ny,float width,float height,float amplitude,float wavelength)
+{
+   int i,j,k;
+   float* T;
+   unsigned short* I;
+   if (nx<2 || ny<2 || (long)nx*ny>65536) Fatal("Flag cannot be %d by %d\n",nx,ny);
+   if (wavelength<=0) Fatal("Flag wavelength %f must be positive\n",wavelength);
+   if (vbo) Fatal("Flag already initialized\n");
+   Nx = nx;
+   Ny = ny;
+   Ncol = (nx+3)/4;
+   A = amplitude;
+   Wave = wavelength;
+   K = 8*atan(1)/wavelength;
+
+   //  Columns and rows (columns aligned for vector loads since malloc may not be)
+   X = (v4sf*)malloc(5*Ncol*sizeof(v4sf)+15);
+   Y = (float*)malloc(ny*sizeof(float));
+   V = (float*)malloc(6*(size_t)nx*ny*sizeof(float));
+   if (!X || !Y || !V) Fatal("Cannot allocate memory for flag\n");
+   X = (v4sf*)(((uintptr_t)X+15) & ~(uintptr_t)15);
+   S = X+Ncol;
+   C = S+Ncol;
+   Z = C+Ncol;
+   N = Z+Ncol;
+   for (i=0;i<4*Ncol;i++)
+   {
+      float x = width*i/(nx-1);
+      ((float*)X)[i] = x;
+      ((float*)S)[i] = sin(K*x);
+      ((float*)C)[i] = cos(K*x);
+   }
+   for (j=0;j<ny;j++)
+      Y[j] = height*j/(ny-1);
+
+   //  Texture spread once over the flag
+   T = (float*)malloc(2*(size_t)nx*ny*sizeof(float));
+   if (!T) Fatal("Cannot allocate memory for flag\n");
+   for (k=j=0;j<ny;j++)
+      for (i=0;i<nx;i++)
+      {
+         T[k++] = i/(float)(nx-1);
+         T[k++] = j/(float)(ny-1);
+      }
+   glGenBuffers(1,&tbo);
+   glBindBuffer(GL_ARRAY_BUFFER,tbo);
+   glBufferData(GL_ARRAY_BUFFER,2*(size_t)nx*ny*sizeof(float),T,GL_STATIC_DRAW);
+   free(T);
+
+   //  Strip up each row of cells with a repeated index at either end to join them
+   Nindex = 2*nx*(ny-1) + 2*(ny-2);
+   I = (unsigned short*)malloc(Nindex*sizeof(unsigned short));
+   if (!I) Fatal("Cannot allocate memory for flag\n");
+   for (k=j=0;j<ny-1;j++)
+   {
+      if (j>0) I[k++] = j*nx;
+      for (i=0;i<nx;i++)
+      {
+         I[k++] = j*nx+i;
+         I[k++] = (j+1)*nx+i;
+      }
+      if (j<ny-2) I[k++] = (j+1)*nx+nx-1;
+   }
+   glGenBuffers(1,&ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,Nindex*sizeof(unsigned short),I,GL_STATIC_DRAW);
+   free(I);
+
+   //  Positions and normals are written when drawn
+   glGenBuffers(1,&vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   ErrCheck("InitFlag");
+}
+
+/*
+ *  Move the wave along the flag towards the origin
+ */
+void AdvanceFlag(double distance)
+{
+   Phase = fmod(Phase+distance,Wave);
+   if (Phase<0) Phase += Wave;
+}
+
+/*
+ *  Positions then normals of every sample
+ */
+static void Vertexes(float* P)
+{
+   int i,j;
+   float* Q = P+3*(size_t)Nx*Ny;
+   const float* x = (const float*)X;
+   const float* z = (const float*)Z;
+   const float* n = (const float*)N;
+   //  Rotate the columns at rest by the phase
+   //    Height is A sin(Kx+phase) and the slope is A K cos(Kx+phase)
+   float s = sin(K*Phase), c = cos(K*Phase);
+#if defined(__GNUC__)
+   for (i=0;i<Ncol;i++)
+   {
+      v4sf sn = S[i]*c+C[i]*s, cs = C[i]*c-S[i]*s;
+      Z[i] = A*sn;
+      N[i] = (A*K)*cs;
+   }
+#else
+   const float* sx = (const float*)S;
+   const float* cx = (const float*)C;
+   for (i=0;i<4*Ncol;i++)
+   {
+      ((float*)Z)[i] = A*(sx[i]*c+cx[i]*s);
+      ((float*)N)[i] = (A*K)*(cx[i]*c-sx[i]*s);
+   }
+#endif
+   //  Spread the columns over the rows
+   for (j=0;j<Ny;j++)
+      for (i=0;i<Nx;i++)
+      {
+         *P++ = x[i];
+         *P++ = Y[j];
+         *P++ = z[i];
+      }
+   //  Unit normals lean against the slope
+   for (i=0;i<Nx;i++)
+   {
+      float r = 1/sqrt(1+n[i]*n[i]);
+      Q[3*i]   = -n[i]*r;
+      Q[3*i+1] = 0;
+      Q[3*i+2] = r;
+   }
+   for (j=1;j<Ny;j++)
+      memcpy(Q+3*(size_t)j*Nx,Q,3*Nx*sizeof(float));
+}
+
+/*
+ *  Draw the flag with the current transform, color and texture
+ *    Returns the number of triangles drawn
+ */
+int DrawFlag(void)
+{
+   size_t bytes = 6*(size_t)Nx*Ny*sizeof(float);
+   float* P;
+   if (!vbo) return 0;
+
+   //  Orphan the old vertexes rather than wait for the GPU to finish with them
+   glBindBuffer(GL_ARRAY_BUFFER,vbo);
+   glBufferData(GL_ARRAY_BUFFER,bytes,NULL,GL_STREAM_DRAW);
+   P = (float*)glMapBuffer(GL_ARRAY_BUFFER,GL_WRITE_ONLY);
+   if (P)
+   {
+      Vertexes(P);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+   }
+   else
+   {
+      Vertexes(V);
+      glBufferData(GL_ARRAY_BUFFER,bytes,V,GL_STREAM_DRAW);
+   }
+
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glVertexPointer(3,GL_FLOAT,0,(void*)0);
+   glNormalPointer(GL_FLOAT,0,(void*)(3*(size_t)Nx*Ny*sizeof(float)));
+   glBindBuffer(GL_ARRAY_BUFFER,tbo);
+   glTexCoordPointer(2,GL_FLOAT,0,(void*)0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
+   glDrawElements(GL_TRIANGLE_STRIP,Nindex,GL_UNSIGNED_SHORT,(void*)0);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+   return 2*(Nx-1)*(Ny-1);
+}
@@ -0,0 +1,16 @@
+#ifndef FLAG
+#define FLAG
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void InitFlag(int nx,int ny,float width,float height,float amplitude,float wavelength);
+void AdvanceFlag(double distance);
+int  DrawFlag(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
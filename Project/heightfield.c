@@ -0,0 +1,223 @@
+/*
+ *  Binary heightfields
+ *
+ *  A heightfield file is a header giving the grid size, sample spacing and
+ *  height range followed by the samples as floats, row by row, and then a
+ *  smooth normal at every sample packed into bytes.  It is mapped and the
+ *  samples are used in place, so loading costs the same however large the
+ *  grid is.  SaveHeightField converts the text DEMs (see dem2hf.c) and works
+ *  out the normals once so nothing else has to.
+ *
+ *  HeightFieldHeight and HeightFieldNormal look up the surface anywhere on
+ *  the grid in constant time.
+ */
+#include "CSCIx229.h"
+#include "heightfield.h"
+
+//  Heightfield header
+#define HF_VERSION 2
+typedef struct
+{
+   char  magic[4];   //  Always HFLD
+   int   version;    //  HF_VERSION
+   int   nx,ny;      //  Samples in x and y
+   float dx,dy;      //  Spacing of samples
+   float zmin,zmax;  //  Height range
+} hf_t;
+
+/*
+ *  Smooth normals from the slope across each sample
+ *    Packed as bytes with the fourth unused
+ */
+static void Normals(const float* z,int nx,int ny,float dx,float dy,signed char* n)
+{
+   int i,j;
+   for (j=0;j<ny;j++)
+      for (i=0;i<nx;i++)
+      {
+         //  Central differences, one sided at the edges
+         int x0 = i>0 ? i-1 : i, x1 = i<nx-1 ? i+1 : i;
+         int y0 = j>0 ? j-1 : j, y1 = j<ny-1 ? j+1 : j;
+         double dzdx = (z[(size_t)j*nx+x1]-z[(size_t)j*nx+x0])/(dx*(x1-x0));
+         double dzdy = (z[(size_t)y1*nx+i]-z[(size_t)y0*nx+i])/(dy*(y1-y0));
+         double len = sqrt(dzdx*dzdx+dzdy*dzdy+1);
+         signed char* p = n+4*((size_t)j*nx+i);
+         p[0] = (signed char)floor(-127*dzdx/len+0.5);
+         p[1] = (signed char)floor(-127*dzdy/len+0.5);
+         p[2] = (signed char)floor(127/len+0.5);
+         p[3] = 0;
+      }
+}
+
+/*
+ *  Convert a text DEM to a heightfield
+ *    The DEM is whitespace separated heights in rows of nx samples
+ *    with nx=0 for a square grid
+ */
+void SaveHeightField(const char* file,const char* drp,float spacing,int nx)
+{
+   long   len=0;
+   size_t k,n=0,m=0;
+   char*  text;
+   char*  p;
+   char*  end;
+   float* z=NULL;
+   signed char* nrm;
+   char   tmp[strlen(file)+5];
+   hf_t   h;
+   FILE*  f;
+
+   //  Read the whole text at once
+   f = fopen(drp,"rb");
+   if (!f) Fatal("Cannot open file %s\n",drp);
+   if (fseek(f,0,SEEK_END) || (len=ftell(f))<0 || fseek(f,0,SEEK_SET)) Fatal("Cannot read file %s\n",drp);
+   text = (char*)malloc(len+1);
+   if (!text) Fatal("Cannot allocate memory for %s\n",drp);
+   if (fread(text,1,len,f)!=len) Fatal("Cannot read file %s\n",drp);
+   text[len] = 0;
+   fclose(f);
+
+   //  Parse heights
+   for (p=text;;p=end)
+   {
+      float v = strtof(p,&end);
+      if (end==p) break;
+      if (n==m)
+      {
+         m = m ? 2*m : 65536;
+         z = (float*)realloc(z,m*sizeof(float));
+         if (!z) Fatal("Cannot allocate memory for %s\n",drp);
+      }
+      z[n++] = v;
+   }
+   while (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')
+      p++;
+   if (*p) Fatal("Error reading %s after %lu heights\n",drp,(unsigned long)n);
+   free(text);
+
+   //  Grid size
+   if (nx<=0) nx = (int)(sqrt(n)+0.5);
+   if (nx<2 || n%nx || n/nx<2) Fatal("%lu heights in %s do not make a grid %d wide\n",(unsigned long)n,drp,nx);
+
+   //  Header
+   memset(&h,0,sizeof(h));
+   memcpy(h.magic,"HFLD",4);
+   h.version = HF_VERSION;
+   h.nx = nx;
+   h.ny = n/nx;
+   h.dx = h.dy = spacing;
+   h.zmin = h.zmax = z[0];
+   for (k=1;k<n;k++)
+   {
+      if (z[k]<h.zmin) h.zmin = z[k];
+      if (z[k]>h.zmax) h.zmax = z[k];
+   }
+
+   //  Normals
+   nrm = (signed char*)malloc(4*n);
+   if (!nrm) Fatal("Cannot allocate memory for %s\n",drp);
+   Normals(z,h.nx,h.ny,h.dx,h.dy,nrm);
+
+   //  Write to a temporary file and rename so a partial heightfield is never seen
+   sprintf(tmp,"%s.tmp",file);
+   f = fopen(tmp,"wb");
+   if (!f) Fatal("Cannot open file %s\n",tmp);
+   if (fwrite(&h,sizeof(h),1,f)!=1 || fwrite(z,sizeof(float),n,f)!=n || fwrite(nrm,4,n,f)!=n || fclose(f) || rename(tmp,file))
+   {
+      remove(tmp);
+      Fatal("Cannot write heightfield %s\n",file);
+   }
+   free(z);
+   free(nrm);
+}
+
+/*
+ *  Map a heightfield
+ *    Returns 0 on success
+ */
+int MapHeightField(const char* file,HeightField* hf)
+{
+   hf_t* h;
+   memset(hf,0,sizeof(HeightField));
+   hf->map = MapFile(file,&hf->len);
+   if (!hf->map) return -1;
+   //  Check header and size
+   h = (hf_t*)hf->map;
+   if (hf->len<sizeof(hf_t) || memcmp(h->magic,"HFLD",4) || h->version!=HF_VERSION ||
+       h->nx<2 || h->ny<2 || hf->len!=sizeof(hf_t)+(sizeof(float)+4)*(size_t)h->nx*h->ny)
+   {
+      fprintf(stderr,"Ignoring corrupt heightfield %s\n",file);
+      UnmapHeightField(hf);
+      return -1;
+   }
+   hf->nx = h->nx;
+   hf->ny = h->ny;
+   hf->dx = h->dx;
+   hf->dy = h->dy;
+   hf->zmin = h->zmin;
+   hf->zmax = h->zmax;
+   hf->z = (const float*)(h+1);
+   hf->n = (const signed char*)(hf->z+(size_t)h->nx*h->ny);
+   return 0;
+}
+
+/*
+ *  Release a heightfield
+ */
+void UnmapHeightField(HeightField* hf)
+{
+   if (hf->map) UnmapFile(hf->map,hf->len);
+   memset(hf,0,sizeof(HeightField));
+}
+
+/*
+ *  Cell holding x,y measured from the first sample and the position in it
+ *    Points off the grid are moved onto its edge
+ */
+static size_t Cell(const HeightField* hf,double x,double y,double* u,double* v)
+{
+   int i,j;
+   x /= hf->dx;
+   y /= hf->dy;
+   x = x<0 ? 0 : x>hf->nx-1 ? hf->nx-1 : x;
+   y = y<0 ? 0 : y>hf->ny-1 ? hf->ny-1 : y;
+   i = (int)x<hf->nx-2 ? (int)x : hf->nx-2;
+   j = (int)y<hf->ny-2 ? (int)y : hf->ny-2;
+   *u = x-i;
+   *v = y-j;
+   return (size_t)j*hf->nx+i;
+}
+
+/*
+ *  Height at x,y measured from the first sample
+ *    Interpolated over the triangles the terrain is drawn with, split along
+ *    the diagonal from (0,0) to (1,1) of each cell
+ */
+double HeightFieldHeight(const HeightField* hf,double x,double y)
+{
+   double u,v;
+   size_t k = Cell(hf,x,y,&u,&v);
+   double h00 = hf->z[k], h10 = hf->z[k+1];
+   double h01 = hf->z[k+hf->nx], h11 = hf->z[k+hf->nx+1];
+   return (v>=u) ? h00 + v*(h01-h00) + u*(h11-h01) : h00 + u*(h10-h00) + v*(h11-h10);
+}
+
+/*
+ *  Unit normal at x,y measured from the first sample
+ *    Interpolated bilinearly between the normals of the samples
+ */
+void HeightFieldNormal(const HeightField* hf,double x,double y,double n[3])
+{
+   int    c;
+   double u,v,len;
+   size_t k = Cell(hf,x,y,&u,&v);
+   const signed char* p00 = hf->n+4*k;
+   const signed char* p10 = p00+4;
+   const signed char* p01 = p00+4*hf->nx;
+   const signed char* p11 = p01+4;
+   for (c=0;c<3;c++)
+      n[c] = (1-v)*((1-u)*p00[c]+u*p10[c]) + v*((1-u)*p01[c]+u*p11[c]);
+   len = sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+   for (c=0;c<3;c++)
+      n[c] /= len;
+}
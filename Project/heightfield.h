@@ -0,0 +1,33 @@
+#ifndef HEIGHTFIELD
+#define HEIGHTFIELD
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Heightfield mapped for rendering
+typedef struct
+{
+   void*        map;   //  Mapped file
+   size_t       len;   //  Length of mapping
+   int          nx;    //  Samples in x
+   int          ny;    //  Samples in y
+   float        dx;    //  Spacing of samples in x
+   float        dy;    //  Spacing of samples in y
+   float        zmin;  //  Lowest sample
+   float        zmax;  //  Highest sample
+   const float* z;     //  Samples in rows of x (sample i,j is z[j*nx+i])
+   const signed char* n;  //  Unit normals scaled by 127 (sample i,j is n[4*(j*nx+i)] to n[4*(j*nx+i)+2])
+} HeightField;
+
+void SaveHeightField(const char* file,const char* drp,float spacing,int nx);
+int  MapHeightField(const char* file,HeightField* hf);
+void UnmapHeightField(HeightField* hf);
+double HeightFieldHeight(const HeightField* hf,double x,double y);
+void HeightFieldNormal(const HeightField* hf,double x,double y,double n[3]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
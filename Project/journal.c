@@ -0,0 +1,121 @@
+/*
+ *  Input journals
+ *
+ *  A journal records every input and timer event of a game session in the
+ *  order the handlers were called, each tagged with the frame it came
+ *  before.  Frames are events too and hold the elapsed time they were
+ *  drawn at, so a replay can run the same handlers on the same clock and
+ *  reproduce the session exactly, as fast as it can draw.
+ *
+ *  The file is a header followed by the events.
+ */
+#include "CSCIx229.h"
+#include "journal.h"
+
+//  Journal file header
+#define JNL_VERSION 1
+typedef struct
+{
+   char magic[4];            // "EJNL"
+   int  version;             // JNL_VERSION
+   int  evsize;              // Bytes per event
+   int  pad;
+} jnl_t;
+
+//  Journal being written
+static FILE* journal=NULL;
+
+/*
+ *  Close the journal when the program exits
+ */
+static void CloseAtExit(void)
+{
+   CloseJournal();
+}
+
+/*
+ *  Start recording to a journal file
+ *    Returns 0 on success
+ */
+int OpenJournal(const char* file)
+{
+   static int atexitSet=0;
+   jnl_t h;
+   if (journal) return -1;
+   journal = fopen(file,"wb");
+   if (!journal) return -1;
+   memset(&h,0,sizeof(h));
+   memcpy(h.magic,"EJNL",4);
+   h.version = JNL_VERSION;
+   h.evsize = sizeof(JournalEvent);
+   if (fwrite(&h,sizeof(h),1,journal)!=1)
+   {
+      fclose(journal);
+      journal = NULL;
+      return -1;
+   }
+   if (!atexitSet) atexit(CloseAtExit);
+   atexitSet = 1;
+   return 0;
+}
+
+/*
+ *  Record one event
+ */
+void WriteJournal(int tick,int type,int a,int b,int c,int d)
+{
+   JournalEvent ev;
+   if (!journal) return;
+   ev.tick = tick;
+   ev.type = type;
+   ev.a = a;
+   ev.b = b;
+   ev.c = c;
+   ev.d = d;
+   fwrite(&ev,sizeof(ev),1,journal);
+}
+
+/*
+ *  Finish recording
+ */
+void CloseJournal(void)
+{
+   int err;
+   if (!journal) return;
+   err = ferror(journal);
+   if (fclose(journal) || err) fprintf(stderr,"Error writing journal\n");
+   journal = NULL;
+}
+
+/*
+ *  Map a journal for replay
+ *    Events are used in place without copying
+ *    Returns 0 on success
+ */
+int MapJournal(const char* file,JournalFile* jnl)
+{
+   const jnl_t* h;
+   memset(jnl,0,sizeof(JournalFile));
+   jnl->map = MapFile(file,&jnl->len);
+   if (!jnl->map) return -1;
+   h = (const jnl_t*)jnl->map;
+   if (jnl->len<sizeof(jnl_t) || memcmp(h->magic,"EJNL",4) ||
+       h->version!=JNL_VERSION || h->evsize!=sizeof(JournalEvent))
+   {
+      UnmapJournal(jnl);
+      return -1;
+   }
+   jnl->ev = (const JournalEvent*)(h+1);
+   //  Whole events only, in case recording was cut short
+   jnl->n = (jnl->len-sizeof(jnl_t))/sizeof(JournalEvent);
+   return 0;
+}
+
+/*
+ *  Release a journal mapped by MapJournal
+ */
+void UnmapJournal(JournalFile* jnl)
+{
+   UnmapFile(jnl->map,jnl->len);
+   memset(jnl,0,sizeof(JournalFile));
+}
@@ -0,0 +1,47 @@
+#ifndef JOURNAL
+#define JOURNAL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Journal event types
+enum
+{
+   J_FRAME,     //  display() called (a = elapsed ms)
+   J_KEY,       //  key(a,b,c)
+   J_SPECIAL,   //  special(a,b,c)
+   J_MOUSE,     //  mouse(a,b,c,d)
+   J_TIMER,     //  timer(a)
+   J_RESHAPE,   //  reshape(a,b)
+   J_MENU       //  Menu d handler called with a
+};
+
+//  One input or event
+typedef struct
+{
+   int tick;    //  Frame the event came before
+   int type;    //  J_*
+   int a,b,c,d; //  Arguments
+} JournalEvent;
+
+//  Journal mapped for replay
+typedef struct
+{
+   void*               map;   //  Mapped file
+   size_t              len;   //  Length of mapping
+   const JournalEvent* ev;    //  Events in the mapping
+   long long           n;     //  Number of events
+} JournalFile;
+
+int  OpenJournal(const char* file);
+void WriteJournal(int tick,int type,int a,int b,int c,int d);
+void CloseJournal(void);
+int  MapJournal(const char* file,JournalFile* jnl);
+void UnmapJournal(JournalFile* jnl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ *  Load textures from BMP files in the background
+ *
+ *  LoadTexBMPAsync returns a texture name at once holding a 1x1 placeholder.
+ *  Worker threads decode the BMP files and queue the images, and
+ *  UploadTextures copies them into their textures on the OpenGL thread.
+ */
+#include "CSCIx229.h"
+#include <pthread.h>
+#include <unistd.h>
+
+//  Decoded images waiting for upload
+//  Workers block when this many are queued which bounds the memory used
+#define MAX_READY 8
+//  Maximum number of worker threads
+#define MAX_WORKERS 4
+
+//  Texture request
+typedef struct job_s
+{
+   struct job_s*  next;      // Next in queue
+   char*          file;      // BMP file
+   int            mip;       // Load mip chain
+   unsigned int   tex;       // Texture name
+   unsigned int   dx,dy;     // Image dimensions
+   int            levels;    // Mip levels
+   unsigned char* image;     // Decoded image
+} job_t;
+
+//  Queues are guarded by one mutex
+static pthread_mutex_t lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work  = PTHREAD_COND_INITIALIZER;  // Job queued
+static pthread_cond_t  ready = PTHREAD_COND_INITIALIZER;  // Image decoded
+static pthread_cond_t  room  = PTHREAD_COND_INITIALIZER;  // Image uploaded
+static job_t* todo=NULL;     // Jobs waiting for a worker
+static job_t* todoEnd=NULL;
+static job_t* done=NULL;     // Images waiting for upload
+static job_t* doneEnd=NULL;
+static int Nready=0;         // Images in done
+static int Npending=0;       // Requests not yet uploaded
+static int Nworker=0;        // Worker threads started
+
+/*
+ *  Append job to queue
+ */
+static void Push(job_t** head,job_t** tail,job_t* job)
+{
+   job->next = NULL;
+   if (*tail)
+      (*tail)->next = job;
+   else
+      *head = job;
+   *tail = job;
+}
+
+/*
+ *  Remove job from front of queue
+ */
+static job_t* Pop(job_t** head,job_t** tail)
+{
+   job_t* job = *head;
+   *head = job->next;
+   if (!*head) *tail = NULL;
+   return job;
+}
+
+/*
+ *  Worker thread decodes images
+ */
+static void* Worker(void* arg)
+{
+   while (1)
+   {
+      job_t* job;
+      //  Wait for a job
+      pthread_mutex_lock(&lock);
+      while (!todo)
+         pthread_cond_wait(&work,&lock);
+      job = Pop(&todo,&todoEnd);
+      pthread_mutex_unlock(&lock);
+      //  Decode without holding the lock
+      if (job->mip)
+         job->image = ReadBMPMip(job->file,&job->dx,&job->dy,&job->levels);
+      else
+      {
+         job->image = ReadBMP(job->file,&job->dx,&job->dy);
+         job->levels = 1;
+      }
+      //  Queue for upload when there is room
+      pthread_mutex_lock(&lock);
+      while (Nready>=MAX_READY)
+         pthread_cond_wait(&room,&lock);
+      Push(&done,&doneEnd,job);
+      Nready++;
+      pthread_cond_signal(&ready);
+      pthread_mutex_unlock(&lock);
+   }
+   return NULL;
+}
+
+/*
+ *  Start worker threads
+ */
+static void StartWorkers(void)
+{
+   int k;
+   int n = sysconf(_SC_NPROCESSORS_ONLN);
+   if (n<1) n = 1;
+   if (n>MAX_WORKERS) n = MAX_WORKERS;
+   for (k=0;k<n;k++)
+   {
+      pthread_t thread;
+      if (pthread_create(&thread,NULL,Worker,NULL)) Fatal("Cannot start texture loader thread\n");
+      pthread_detach(thread);
+   }
+   Nworker = n;
+}
+
+/*
+ *  Load texture from BMP file in the background
+ *    Returns the texture name which holds a 1x1 placeholder until the image is uploaded
+ *    Set mip to load the mip chain as LoadTexBMPMip does
+ */
+unsigned int LoadTexBMPAsync(const char* file,int mip)
+{
+   unsigned int texture;
+   const unsigned char grey[3] = {128,128,128};
+   job_t* job = (job_t*)malloc(sizeof(job_t));
+   if (!job) Fatal("Cannot allocate memory for texture %s\n",file);
+   job->file = strdup(file);
+   if (!job->file) Fatal("Cannot allocate memory for texture %s\n",file);
+   job->mip = mip;
+
+   //  Sanity check
+   ErrCheck("LoadTexBMPAsync");
+   //  Generate 2D texture with the placeholder
+   glGenTextures(1,&texture);
+   glBindTexture(GL_TEXTURE_2D,texture);
+   glTexImage2D(GL_TEXTURE_2D,0,3,1,1,0,GL_RGB,GL_UNSIGNED_BYTE,grey);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+   job->tex = texture;
+
+   //  Queue job
+   if (!Nworker) StartWorkers();
+   pthread_mutex_lock(&lock);
+   Push(&todo,&todoEnd,job);
+   Npending++;
+   pthread_cond_signal(&work);
+   pthread_mutex_unlock(&lock);
+   return texture;
+}
+
+/*
+ *  Upload decoded textures
+ *    Call once per frame from the OpenGL thread
+ *    Stops after budget bytes but always uploads at least one image
+ *    Returns the number of textures still loading
+ */
+int UploadTextures(int budget)
+{
+   int bytes=0,n;
+   //  Texture bindings are restored afterwards
+   glPushAttrib(GL_TEXTURE_BIT);
+   while (bytes<budget)
+   {
+      job_t* job;
+      //  Take the next decoded image
+      pthread_mutex_lock(&lock);
+      if (!done)
+      {
+         pthread_mutex_unlock(&lock);
+         break;
+      }
+      job = Pop(&done,&doneEnd);
+      Nready--;
+      pthread_cond_signal(&room);
+      pthread_mutex_unlock(&lock);
+      //  Replace the placeholder
+      glBindTexture(GL_TEXTURE_2D,job->tex);
+      TexImageBMP(job->file,job->dx,job->dy,job->levels,job->image);
+      bytes += 3*job->dx*job->dy;
+      //  Done with this request
+      pthread_mutex_lock(&lock);
+      Npending--;
+      pthread_mutex_unlock(&lock);
+      free(job->image);
+      free(job->file);
+      free(job);
+   }
+   glPopAttrib();
+   ErrCheck("UploadTextures");
+   //  Number still loading
+   pthread_mutex_lock(&lock);
+   n = Npending;
+   pthread_mutex_unlock(&lock);
+   return n;
+}
+
+/*
+ *  Wait until every queued texture is uploaded
+ */
+void FinishTextures(void)
+{
+   while (1)
+   {
+      //  Wait for an image or for nothing to be left
+      pthread_mutex_lock(&lock);
+      while (!done && Npending)
+         pthread_cond_wait(&ready,&lock);
+      pthread_mutex_unlock(&lock);
+      if (!UploadTextures(0x7FFFFFFF)) break;
+   }
+}
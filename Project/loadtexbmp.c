@@ -19,19 +19,22 @@ static void Reverse(void* x,const int n)
 }
 
 /*
- *  Load texture from BMP file
+ *  Read 24 bit BMP file
+ *    Returns RGB image which the caller frees
+ *    Makes no OpenGL calls so it is safe on any thread
  */
-unsigned int LoadTexBMP(const char* file)
+unsigned char* ReadBMP(const char* file,unsigned int* DX,unsigned int* DY)
 {
-   unsigned int   texture;    // Texture name
    FILE*          f;          // File pointer
    unsigned short magic;      // Image magic
-   unsigned int   dx,dy,size; // Image dimensions
+   unsigned int   dx,dy;      // Image dimensions
+   size_t         size;       // Image bytes
+   long long      flen,mtime; // File length
    unsigned short nbp,bpp;    // Planes and bits per pixel
    unsigned char* image;      // Image data
    unsigned int   off;        // Image offset
    unsigned int   k;          // Counter
-   int            max;        // Maximum texture dimensions
+   size_t         n;          // Byte counter
 
    //  Open file
    f = fopen(file,"rb");
@@ -54,10 +57,9 @@ unsigned int LoadTexBMP(const char* file)
       Reverse(&bpp,2);
       Reverse(&k,4);
    }
-   //  Check image parameters
-   glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max);
-   if (dx<1 || dx>max) Fatal("%s image width %d out of range 1-%d\n",file,dx,max);
-   if (dy<1 || dy>max) Fatal("%s image height %d out of range 1-%d\n",file,dy,max);
+   //  Check image parameters (TexImageBMP checks the OpenGL limits)
+   if (dx<1 || dx>65536) Fatal("%s image width %d out of range 1-65536\n",file,dx);
+   if (dy<1 || dy>65536) Fatal("%s image height %d out of range 1-65536\n",file,dy);
    if (nbp!=1)  Fatal("%s bit planes is not 1: %d\n",file,nbp);
    if (bpp!=24) Fatal("%s bits per pixel is not 24: %d\n",file,bpp);
    if (k!=0)    Fatal("%s compressed files not supported\n",file);
@@ -69,20 +71,265 @@ unsigned int LoadTexBMP(const char* file)
    if (k!=dy) Fatal("%s image height not a power of two: %d\n",file,dy);
 #endif
 
+   //  Check the image fits in the file before allocating
+   size = 3*(size_t)dx*dy;
+   if (FileStamp(file,&flen,&mtime) || off>flen || size>(unsigned long long)(flen-off))
+      Fatal("%s image data %dx%d is past the end of the file\n",file,dx,dy);
+
    //  Allocate image memory
-   size = 3*dx*dy;
    image = (unsigned char*) malloc(size);
-   if (!image) Fatal("Cannot allocate %d bytes of memory for image %s\n",size,file);
+   if (!image) Fatal("Cannot allocate %lu bytes of memory for image %s\n",(unsigned long)size,file);
    //  Seek to and read image
    if (fseek(f,off,SEEK_SET) || fread(image,size,1,f)!=1) Fatal("Error reading data from image %s\n",file);
    fclose(f);
    //  Reverse colors (BGR -> RGB)
-   for (k=0;k<size;k+=3)
+   for (n=0;n<size;n+=3)
+   {
+      unsigned char temp = image[n];
+      image[n]   = image[n+2];
+      image[n+2] = temp;
+   }
+   *DX = dx;
+   *DY = dy;
+   return image;
+}
+
+/*
+ *  Mip chain cache header
+ *    The levels follow as packed RGB rows, largest first
+ */
+#define MIP_VERSION 1
+typedef struct
+{
+   char magic[4];            // "MIPC"
+   int  version;             // MIP_VERSION
+   long long size,mtime;     // Stamp of the BMP file
+   unsigned int dx,dy;       // Level 0 dimensions
+   int  levels;              // Number of levels
+   int  pad;
+} mip_t;
+
+/*
+ *  Bytes in a mip chain
+ */
+static size_t MipBytes(unsigned int dx,unsigned int dy,int* levels)
+{
+   size_t n = 0;
+   int    l = 0;
+   while (1)
+   {
+      n += 3*(size_t)dx*dy;
+      l++;
+      if (dx==1 && dy==1) break;
+      dx = dx>1 ? dx/2 : 1;
+      dy = dy>1 ? dy/2 : 1;
+   }
+   *levels = l;
+   return n;
+}
+
+/*
+ *  Build the mip chain with a 2x2 box filter
+ *    Level 0 must already be at the start of chain
+ *    Odd edges reuse the last row or column
+ */
+static void BuildMips(unsigned char* chain,unsigned int dx,unsigned int dy)
+{
+   unsigned char* src = chain;
+   while (dx>1 || dy>1)
+   {
+      unsigned int   i,j,c;
+      unsigned int   nx = dx>1 ? dx/2 : 1;
+      unsigned int   ny = dy>1 ? dy/2 : 1;
+      unsigned char* dst = src + 3*(size_t)dx*dy;
+      for (j=0;j<ny;j++)
+      {
+         const unsigned char* r0 = src + 3*(size_t)dx*(2*j<dy ? 2*j : dy-1);
+         const unsigned char* r1 = src + 3*(size_t)dx*(2*j+1<dy ? 2*j+1 : dy-1);
+         for (i=0;i<nx;i++)
+         {
+            unsigned int i0 = 3*(2*i<dx ? 2*i : dx-1);
+            unsigned int i1 = 3*(2*i+1<dx ? 2*i+1 : dx-1);
+            for (c=0;c<3;c++)
+               dst[3*((size_t)nx*j+i)+c] = (r0[i0+c]+r0[i1+c]+r1[i0+c]+r1[i1+c]+2)/4;
+         }
+      }
+      src = dst;
+      dx = nx;
+      dy = ny;
+   }
+}
+
+/*
+ *  Map mip chain cache
+ *    Returns the mapping if the cache matches the BMP size and time
+ */
+static unsigned char* ReadMips(const char* cache,long long size,long long mtime,mip_t* h,size_t* len)
+{
+   int levels;
+   //  Map file
+   unsigned char* map = (unsigned char*)MapFile(cache,len);
+   if (!map) return NULL;
+   //  Check header and size
+   memcpy(h,map,*len<sizeof(mip_t) ? *len : sizeof(mip_t));
+   if (*len<sizeof(mip_t) || memcmp(h->magic,"MIPC",4) || h->version!=MIP_VERSION ||
+       h->size!=size || h->mtime!=mtime || h->dx<1 || h->dx>65536 || h->dy<1 || h->dy>65536 ||
+       *len!=sizeof(mip_t)+MipBytes(h->dx,h->dy,&levels) || h->levels!=levels)
+   {
+      UnmapFile(map,*len);
+      return NULL;
+   }
+   return map;
+}
+
+/*
+ *  Save mip chain cache
+ *    Failure only costs building the chain again next time
+ */
+static void WriteMips(const char* cache,mip_t* h,const unsigned char* chain,size_t n)
+{
+   char  tmp[strlen(cache)+5];
+   FILE* f;
+   int   err;
+   //  Write to a temporary file and rename so a partial cache is never seen
+   sprintf(tmp,"%s.tmp",cache);
+   f = fopen(tmp,"wb");
+   if (!f)
+   {
+      fprintf(stderr,"Cannot write mip cache %s\n",cache);
+      return;
+   }
+   fwrite(h,sizeof(mip_t),1,f);
+   fwrite(chain,n,1,f);
+   err = ferror(f);
+   if (fclose(f) || err || rename(tmp,cache))
+   {
+      fprintf(stderr,"Cannot write mip cache %s\n",cache);
+      remove(tmp);
+   }
+}
+
+#ifndef GL_TEXTURE_MAX_ANISOTROPY_EXT
+#define GL_TEXTURE_MAX_ANISOTROPY_EXT     0x84FE
+#define GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT 0x84FF
+#endif
+
+/*
+ *  Read 24 bit BMP file and its mip chain
+ *    The mip chain is cached in file.mip
+ *    Returns the levels packed largest first which the caller frees
+ *    Makes no OpenGL calls so it is safe on any thread
+ */
+unsigned char* ReadBMPMip(const char* file,unsigned int* dx,unsigned int* dy,int* levels)
+{
+   long long      size,mtime; // BMP file stamp
+   mip_t          h;          // Cache header
+   unsigned char* chain;      // Mip chain
+   unsigned char* map;        // Mapped cache
+   size_t         len,n;      // Cache and chain bytes
+   char cache[strlen(file)+5];
+
+   //  Check file
+   if (FileStamp(file,&size,&mtime)) Fatal("Cannot open file %s\n",file);
+   sprintf(cache,"%s.mip",file);
+
+   //  Use cache if current
+   map = ReadMips(cache,size,mtime,&h,&len);
+   if (map)
    {
-      unsigned char temp = image[k];
-      image[k]   = image[k+2];
-      image[k+2] = temp;
+      n = len-sizeof(mip_t);
+      chain = (unsigned char*)malloc(n);
+      if (!chain) Fatal("Cannot allocate %lu bytes of memory for mipmaps %s\n",(unsigned long)n,file);
+      memcpy(chain,map+sizeof(mip_t),n);
+      UnmapFile(map,len);
    }
+   //  Otherwise read image, build chain and save
+   else
+   {
+      unsigned char* image = ReadBMP(file,&h.dx,&h.dy);
+      memcpy(h.magic,"MIPC",4);
+      h.version = MIP_VERSION;
+      h.size  = size;
+      h.mtime = mtime;
+      h.pad = 0;
+      n = MipBytes(h.dx,h.dy,&h.levels);
+      chain = (unsigned char*)realloc(image,n);
+      if (!chain) Fatal("Cannot allocate %lu bytes of memory for mipmaps %s\n",(unsigned long)n,file);
+      BuildMips(chain,h.dx,h.dy);
+      WriteMips(cache,&h,chain,n);
+   }
+   *dx = h.dx;
+   *dy = h.dy;
+   *levels = h.levels;
+   return chain;
+}
+
+/*
+ *  Copy image to the bound texture
+ *    One level uses linear filtering like LoadTexBMP
+ *    A mip chain uses trilinear and anisotropic filtering when available
+ */
+void TexImageBMP(const char* file,unsigned int dx,unsigned int dy,int levels,const unsigned char* image)
+{
+   int    k;      // Level
+   int    max;    // Maximum texture dimensions
+   size_t n;      // Offset of level
+   const char* ext;  // Extensions
+
+   //  Check image parameters
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max);
+   if (dx<1 || dx>max) Fatal("%s image width %d out of range 1-%d\n",file,dx,max);
+   if (dy<1 || dy>max) Fatal("%s image height %d out of range 1-%d\n",file,dy,max);
+
+   //  Single level
+   if (levels<=1)
+   {
+      //  Copy image
+      glTexImage2D(GL_TEXTURE_2D,0,3,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,image);
+      if (glGetError()) Fatal("Error in glTexImage2D %s %dx%d\n",file,dx,dy);
+      //  Scale linearly when image size doesn't match
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+      return;
+   }
+
+   //  Copy levels (small levels have rows that are not 4 byte aligned)
+   glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+   glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+   for (k=0,n=0;k<levels;k++)
+   {
+      glTexImage2D(GL_TEXTURE_2D,k,3,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,image+n);
+      if (glGetError()) Fatal("Error in glTexImage2D %s level %d %dx%d\n",file,k,dx,dy);
+      n += 3*(size_t)dx*dy;
+      dx = dx>1 ? dx/2 : 1;
+      dy = dy>1 ? dy/2 : 1;
+   }
+   glPopClientAttrib();
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAX_LEVEL,levels-1);
+   //  Trilinear filtering
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
+   //  Anisotropic filtering for surfaces seen at grazing angles
+   ext = (const char*)glGetString(GL_EXTENSIONS);
+   if (ext && strstr(ext,"GL_EXT_texture_filter_anisotropic"))
+   {
+      float aniso;
+      glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT,&aniso);
+      glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_MAX_ANISOTROPY_EXT,aniso);
+   }
+}
+
+/*
+ *  Load texture from BMP file
+ */
+unsigned int LoadTexBMP(const char* file)
+{
+   unsigned int   texture;    // Texture name
+   unsigned int   dx,dy;      // Image dimensions
+   unsigned char* image;      // Image data
+
+   //  Read image
+   image = ReadBMP(file,&dx,&dy);
 
    //  Sanity check
    ErrCheck("LoadTexBMP");
@@ -90,14 +337,37 @@ unsigned int LoadTexBMP(const char* file)
    glGenTextures(1,&texture);
    glBindTexture(GL_TEXTURE_2D,texture);
    //  Copy image
-   glTexImage2D(GL_TEXTURE_2D,0,3,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,image);
-   if (glGetError()) Fatal("Error in glTexImage2D %s %dx%d\n",file,dx,dy);
-   //  Scale linearly when image size doesn't match
-   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+   TexImageBMP(file,dx,dy,1,image);
 
    //  Free image memory
    free(image);
    //  Return texture name
    return texture;
 }
+
+/*
+ *  Load mipmapped texture from BMP file
+ */
+unsigned int LoadTexBMPMip(const char* file)
+{
+   unsigned int   texture;    // Texture name
+   unsigned int   dx,dy;      // Image dimensions
+   int            levels;     // Mip levels
+   unsigned char* chain;      // Mip chain
+
+   //  Read image and mip chain
+   chain = ReadBMPMip(file,&dx,&dy,&levels);
+
+   //  Sanity check
+   ErrCheck("LoadTexBMPMip");
+   //  Generate 2D texture
+   glGenTextures(1,&texture);
+   glBindTexture(GL_TEXTURE_2D,texture);
+   //  Copy levels
+   TexImageBMP(file,dx,dy,levels,chain);
+
+   //  Free chain
+   free(chain);
+   //  Return texture name
+   return texture;
+}
@@ -0,0 +1,85 @@
+/*
+ *  Map files into memory and query file stamps
+ */
+#include "CSCIx229.h"
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ *  Map a file read only
+ *    Returns pointer to the data or NULL on error or empty file
+ */
+void* MapFile(const char* file,size_t* size)
+{
+#ifdef _WIN32
+   //  No mmap so read the whole file instead
+   void* data;
+   long  len;
+   FILE* f = fopen(file,"rb");
+   *size = 0;
+   if (!f) return NULL;
+   if (fseek(f,0,SEEK_END) || (len=ftell(f))<=0 || fseek(f,0,SEEK_SET))
+   {
+      fclose(f);
+      return NULL;
+   }
+   data = malloc(len);
+   if (!data) Fatal("Cannot allocate %ld bytes for %s\n",len,file);
+   if (fread(data,len,1,f)!=1)
+   {
+      free(data);
+      data = NULL;
+   }
+   else
+      *size = len;
+   fclose(f);
+   return data;
+#else
+   struct stat st;
+   void* data;
+   int fd = open(file,O_RDONLY);
+   *size = 0;
+   if (fd<0) return NULL;
+   if (fstat(fd,&st) || st.st_size<=0)
+   {
+      close(fd);
+      return NULL;
+   }
+   data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+   //  The mapping stays valid after the descriptor is closed
+   close(fd);
+   if (data==MAP_FAILED) return NULL;
+   *size = st.st_size;
+   return data;
+#endif
+}
+
+/*
+ *  Release a file mapped with MapFile
+ */
+void UnmapFile(void* data,size_t size)
+{
+   if (!data) return;
+#ifdef _WIN32
+   free(data);
+#else
+   munmap(data,size);
+#endif
+}
+
+/*
+ *  Get size and modification time of a file
+ *    Returns 0 on success
+ */
+int FileStamp(const char* file,long long* size,long long* mtime)
+{
+   struct stat st;
+   if (stat(file,&st)) return -1;
+   *size  = st.st_size;
+   *mtime = st.st_mtime;
+   return 0;
+}
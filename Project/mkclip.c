@@ -0,0 +1,19 @@
+/*
+ *  Pack a numbered BMP sequence into a clip for OpenVideo
+ *
+ *  Usage: mkclip <path> <count> <clip> [fps]
+ *  Reads path-1.bmp .. path-count.bmp
+ */
+#include "CSCIx229.h"
+
+int main(int argc,char* argv[])
+{
+   int    count;
+   double fps = 20;
+   if (argc!=4 && argc!=5) Fatal("Usage: mkclip <path> <count> <clip> [fps]\n");
+   count = atoi(argv[2]);
+   if (count<1) Fatal("Frame count must be positive: %s\n",argv[2]);
+   if (argc==5) fps = atof(argv[4]);
+   SaveClip(argv[3],argv[1],count,fps);
+   return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ *  Cut a heightfield and its texture into a tile store for OpenTerrainTiles
+ *
+ *  Usage: mktiles <hf> <bmp> <tiles> [tile] [tex]
+ *  Tiles are tile cells across (default 64) with a tex x tex texture (default 256)
+ */
+#include "CSCIx229.h"
+#include "tiles.h"
+
+int main(int argc,char* argv[])
+{
+   int tile=64,tex=256,k;
+   if (argc<4 || argc>6) Fatal("Usage: mktiles <hf> <bmp> <tiles> [tile] [tex]\n");
+   if (argc>=5) tile = atoi(argv[4]);
+   if (argc==6) tex = atoi(argv[5]);
+   if (tile<1) Fatal("Tile size must be positive: %s\n",argv[4]);
+   //  Textures are powers of two big enough to keep rows 4 byte aligned
+   for (k=4;k<tex;k*=2);
+   if (k!=tex) Fatal("Texture size must be a power of two from 4: %s\n",argv[5]);
+   SaveTerrainTiles(argv[3],argv[1],argv[2],tile,tex);
+   return 0;
+}
@@ -1,5 +1,9 @@
 #include "CSCIx229.h"
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
 
 //  Load an OBJ file
 //  Vertex, Normal and Texture coordinates are supported
@@ -23,13 +27,155 @@ typedef struct
    char* name;                 //  Material name
    float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
    float d;                    //  Transparency
-   int map;                    //  Texture
+   char* map;                  //  Texture file
+   int tex;                    //  Texture
 } mtl_t;
 
 //  Material count and array
 static int Nmtl=0;
 static mtl_t* mtl=NULL;
 
+//  Material library stamps (size and time -1 if missing)
+typedef struct
+{
+   char* name;            //  Library file
+   long long size,mtime;  //  Size and modification time
+} lib_t;
+
+//  Material library count and array
+static int Nlib=0;
+static lib_t* lib=NULL;
+
+//  Parsed OBJ file
+typedef struct
+{
+   int nv,nt,nn;  //  Number of vertex, texture and normal coordinates
+   int nf,nc,nu;  //  Number of facets, facet corners and material changes
+   float* V;      //  Vertex coordinates (x,y,z)
+   float* T;      //  Texture coordinates (s,t)
+   float* N;      //  Normal coordinates (x,y,z)
+   int*   F;      //  Number of corners in each facet
+   int*   C;      //  Vertex/Texture/Normal triplet for each corner (0 for none)
+   int*   U;      //  Facet/Material pair for each material change
+} obj_t;
+
+//  Packed mesh
+//    Every distinct Vertex/Texture/Normal triplet becomes one vertex
+//    and facets are split into triangles grouped by material
+//    The arrays either belong to the packer or point into a mapped cache file
+typedef struct
+{
+   int nv,ni,nr;     //  Number of vertexes, indexes and material ranges
+   float* V;         //  Interleaved vertexes (x,y,z,nx,ny,nz,s,t)
+   unsigned int* I;  //  Triangle indexes
+   int* R;           //  Material/First index/Index count for each range
+} mesh_t;
+#define VSTRIDE 8
+
+//  Mesh cache
+//    The packed mesh is saved next to the source as a binary file
+//    which is mapped directly on later runs as long as the OBJ
+//    file and its material libraries keep the same size and
+//    modification time
+#define CACHE_VERSION 5
+typedef struct
+{
+   char magic[4];         //  Always OBJC
+   int  version;          //  Cache format version
+   long long size,mtime;  //  Size and modification time of the OBJ file
+   int  nv,ni,nr;         //  Number of vertexes, indexes and material ranges
+   int  nm,ns;            //  Number of materials and size of the string table
+   int  nl;               //  Number of material libraries
+} cache_t;
+//  Cached material library
+typedef struct
+{
+   int  name;             //  String table offset
+   int  pad;              //  Keep stamps 8 byte aligned
+   long long size,mtime;  //  Size and modification time (-1 if missing)
+} clib_t;
+//  Cached material
+typedef struct
+{
+   int   name,map;             //  String table offsets (-1 for none)
+   float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
+   float d;                    //  Transparency
+} cmtl_t;
+
+//  Material range of an uploaded model
+typedef struct
+{
+   int   set;                  //  Set material (otherwise keep current material)
+   float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
+   int   tex;                  //  Texture
+   int   first,count;          //  Index range
+} range_t;
+
+//  Uploaded model
+typedef struct
+{
+   unsigned int vbo,ibo;  //  Vertex and index buffers
+   int nr;                //  Number of material ranges
+   range_t* R;            //  Material ranges
+} model_t;
+
+//  Model count and array
+static int Nmodel=0;
+static model_t* model=NULL;
+
+//  Loader arena
+//    All memory used while loading comes from a list of large blocks
+//    which are released together when LoadOBJ returns
+typedef struct block_t
+{
+   struct block_t* next;  //  Next block
+   size_t size,used;      //  Bytes in block and bytes handed out
+} block_t;
+#define BLOCK_HEAD ((sizeof(block_t)+15) & ~(size_t)15)
+static block_t* arena=NULL;
+
+//
+//  Make sure the current arena block has room for n bytes
+//
+static void ArenaReserve(size_t n)
+{
+   block_t* b;
+   if (arena && arena->size-arena->used >= n) return;
+   if (n<65536) n = 65536;
+   b = (block_t*)malloc(BLOCK_HEAD+n);
+   if (!b) Fatal("Cannot allocate %lu bytes for loader\n",(unsigned long)n);
+   b->next = arena;
+   b->size = n;
+   b->used = 0;
+   arena = b;
+}
+
+//
+//  Allocate n bytes from the arena (16 byte aligned)
+//
+static void* ArenaAlloc(size_t n)
+{
+   void* p;
+   n = (n+15) & ~(size_t)15;
+   ArenaReserve(n);
+   p = (char*)arena + BLOCK_HEAD + arena->used;
+   arena->used += n;
+   return p;
+}
+
+//
+//  Release all arena blocks
+//
+static void ArenaFree(void)
+{
+   while (arena)
+   {
+      block_t* b = arena->next;
+      free(arena);
+      arena = b;
+   }
+}
+
 //
 //  Return true if CR or LF
 //
@@ -39,124 +185,215 @@ static int CRLF(char ch)
 }
 
 //
-//  Read line from file
-//    Returns pointer to line or NULL on EOF
+//  Return true for whitespace inside a line
 //
-static int linelen=0;    //  Length of line
-static char* line=NULL;  //  Internal storage for line
-static char* readline(FILE* f)
+static int blank(char ch)
 {
-   char ch;  //  Character read
-   int k=0;  //  Character count
-   while ((ch = fgetc(f)) != EOF)
+   return ch==' ' || ch=='\t' || ch=='\v' || ch=='\f';
+}
+
+//
+//  Find next line in the text range [*p,e)
+//    Returns start of line and sets *p to the end of the line
+//    Returns NULL at the end of the range
+//
+static const char* nextline(const char** p,const char* e)
+{
+   const char* s = *p;
+   //  Skip CR and LF
+   while (s<e && CRLF(*s))
+      s++;
+   if (s==e) return NULL;
+   //  Read until next CR or LF
+   for (*p=s;*p<e && !CRLF(**p);(*p)++);
+   return s;
+}
+
+//
+//  Find next word in the text range [*p,e)
+//    Returns start of word and sets *w to the end of the word
+//    Returns NULL at the end of the range
+//
+static const char* nextword(const char** p,const char* e,const char** w)
+{
+   const char* s = *p;
+   //  Skip leading whitespace
+   while (s<e && blank(*s))
+      s++;
+   if (s==e) return NULL;
+   //  Read until next whitespace
+   *w = s;
+   while (*w<e && !blank(**w))
+      (*w)++;
+   *p = *w;
+   return s;
+}
+
+//
+//  Read word conditionally
+//     Line [p,e) must start with skip string followed by whitespace
+//     Returns start of the next word and sets *w to its end
+//
+static const char* readstr(const char* p,const char* e,const char* skip,const char** w)
+{
+   int n = strlen(skip);
+   if (e-p<=n || strncmp(p,skip,n) || !blank(p[n])) return NULL;
+   p += n;
+   return nextword(&p,e,w);
+}
+
+//
+//  Copy word [s,e) to the arena
+//
+static char* copyword(const char* s,const char* e)
+{
+   char* str = (char*)ArenaAlloc(e-s+1);
+   memcpy(str,s,e-s);
+   str[e-s] = 0;
+   return str;
+}
+
+//
+//  Scan float at the start of word [s,e)
+//    Plain decimals with up to 19 digits are converted here,
+//    anything else goes to strtof which is what sscanf uses
+//    Returns 0 if the word does not start with a float
+//
+static int scanfloat(const char* s,const char* e,float* x)
+{
+   static const double p10[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+                                1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+   const char* p = s;
+   int neg=0,nd=0,ex=0;
+   uint64_t m=0;
+   //  Sign
+   if (p<e && (*p=='-' || *p=='+')) neg = (*p++=='-');
+   //  Integer and fraction digits
+   for (;p<e && isdigit((unsigned char)*p);p++,nd++)
+      m = 10*m + (*p-'0');
+   if (p<e && *p=='.')
+      for (p++;p<e && isdigit((unsigned char)*p);p++,nd++,ex--)
+         m = 10*m + (*p-'0');
+   //  Exponent
+   if (p<e && (*p=='e' || *p=='E'))
+   {
+      int en=0,es=1;
+      p++;
+      if (p<e && (*p=='-' || *p=='+')) es = (*p++=='-') ? -1 : +1;
+      if (p==e || !isdigit((unsigned char)*p)) p = e+1;
+      for (;p<e && isdigit((unsigned char)*p) && en<1000;p++)
+         en = 10*en + (*p-'0');
+      ex += es*en;
+   }
+   //  Fast path needs the whole word and exactly representable parts
+   if (p==e && nd>0 && nd<=19)
    {
-      //  Allocate more memory for long strings
-      if (k>=linelen)
+      double d;
+      uint64_t b;
+      if (m==0)
       {
-         linelen += 8192;
-         line = (char*)realloc(line,linelen);
-         if (!line) Fatal("Out of memory in readline\n");
+         *x = neg ? -0.0f : 0.0f;
+         return 1;
       }
-      //  End of Line
-      if (CRLF(ch))
+      if (m < (1ull<<53) && ex>=-22 && ex<=22)
       {
-         // Eat extra CR or LF characters (if any)
-         while ((ch = fgetc(f)) != EOF)
-           if (!CRLF(ch)) break;
-         //  Stick back the overrun
-         if (ch != EOF) ungetc(ch,f);
-         //  Bail
-         break;
+         d = ex<0 ? m/p10[-ex] : m*p10[ex];
+         memcpy(&b,&d,sizeof(b));
+         //  The correctly rounded double gives the correctly rounded float
+         //  unless it lands exactly on a midpoint between two floats
+         if (d>=1e-37 && d<=1e38 && (b & 0x1FFFFFFF)!=0x10000000)
+         {
+            *x = neg ? -(float)d : (float)d;
+            return 1;
+         }
       }
-      //  Pad character to line
-      else
-         line[k++] = ch;
-   }
-   //  Terminate line if anything was read
-   if (k>0) line[k] = 0;
-   //  Return pointer to line or NULL on EOF
-   return k>0 ? line : NULL;
+   }
+   //  Slow path
+   {
+      char  buf[64];
+      char* str = (e-s<(int)sizeof(buf)) ? buf : (char*)malloc(e-s+1);
+      char* end;
+      if (!str) Fatal("Cannot allocate %d for float\n",(int)(e-s+1));
+      memcpy(str,s,e-s);
+      str[e-s] = 0;
+      *x = strtof(str,&end);
+      p = end;
+      if (str!=buf) free(str);
+      return p!=str;
+   }
 }
 
 //
-//  Read to next non-whitespace word
-//  Note that this destroys line in the process
+//  Scan integer from [*p,e) in the same way as sscanf %d
+//    Returns 0 if there are no digits
 //
-static char* getword(char** line)
+static int scanint(const char** p,const char* e,int* k)
 {
-   char* word;
-   //  Skip leading whitespace
-   while (**line && isspace(**line))
-      (*line)++;
-   if (!**line) return NULL;
-   //  Start of word
-   word = *line;
-   //  Read until next whitespace
-   while (**line && !isspace(**line))
-      (*line)++;
-   //  Mark end of word if not NULL
-   if (**line)
-   {
-      **line = 0;
-      (*line)++;
-   }
-   return word;
+   const char* s = *p;
+   int neg = 0;
+   long long n = 0;
+   if (s<e && (*s=='-' || *s=='+')) neg = (*s++=='-');
+   if (s==e || !isdigit((unsigned char)*s)) return 0;
+   for (;s<e && isdigit((unsigned char)*s);s++)
+      if (n<=INT_MAX) n = 10*n + (*s-'0');
+   *k = neg ? -n : n;
+   *p = s;
+   return 1;
 }
 
 //
-//  Read n floats
+//  Scan n floats from [p,e)
+//    Returns 0 and puts the same message the old sscanf reader gave in err
 //
-static void readfloat(char* line,int n,float x[])
+static int scanfloats(const char* p,const char* e,int n,float x[],char* err,int len)
 {
    int i;
    for (i=0;i<n;i++)
    {
-      char* str = getword(&line);
-      if (!str)  Fatal("Premature EOL reading %d floats\n",n);
-      if (sscanf(str,"%f",x+i)!=1) Fatal("Error reading float %d\n",i);
+      const char* w;
+      const char* s = nextword(&p,e,&w);
+      if (!s)
+      {
+         snprintf(err,len,"Premature EOL reading %d floats\n",n);
+         return 0;
+      }
+      if (!scanfloat(s,w,x+i))
+      {
+         snprintf(err,len,"Error reading float %d\n",i);
+         return 0;
+      }
    }
+   return 1;
 }
 
 //
-//  Read coordinates
-//    n is how many coordiantes to read
-//    N is the coordinate index
-//    M is the number of coordinates
-//    x is the array
-//    This function adds more memory as needed in 8192 work chunks
+//  Add new material with default colors
 //
-static void readcoord(char* line,int n,float* x[],int* N,int* M)
+static mtl_t* NewMaterial(const char* s,const char* e)
 {
-   //  Allocate memory if necessary
-   if (*N+n > *M)
-   {
-      *M += 8192;
-      *x = (float*)realloc(*x,(*M)*sizeof(float));
-      if (!*x) Fatal("Cannot allocate memory\n");
-   }
-   //  Read n coordinates
-   readfloat(line,n,(*x)+*N);
-   (*N)+=n;
+   mtl_t* m = mtl+Nmtl++;
+   //  Store name
+   m->name = copyword(s,e);
+   //  Initialize materials
+   m->Ka[0] = m->Ka[1] = m->Ka[2] = 0;   m->Ka[3] = 1;
+   m->Kd[0] = m->Kd[1] = m->Kd[2] = 0;   m->Kd[3] = 1;
+   m->Ks[0] = m->Ks[1] = m->Ks[2] = 0;   m->Ks[3] = 1;
+   m->Ns  = 0;
+   m->d   = 0;
+   m->map = NULL;
+   m->tex = 0;
+   return m;
 }
 
 //
-//  Read string conditionally
-//     Line must start with skip string
-//     After skip sting return first word
-//     getword terminates the line
+//  Make room for n more materials
+//    Material tables are small so they are copied to grow
 //
-static char* readstr(char* line,const char* skip)
+static void MoreMaterials(int n)
 {
-   //  Check for a match on the skip string
-   while (*skip && *line && *skip==*line)
-   {
-      skip++;
-      line++;
-   }
-   //  Skip must be NULL for a match
-   if (*skip || !isspace(*line)) return NULL;
-   //  Read string
-   return getword(&line);
+   mtl_t* m = (mtl_t*)ArenaAlloc((Nmtl+n+1)*sizeof(mtl_t));
+   if (Nmtl) memcpy(m,mtl,Nmtl*sizeof(mtl_t));
+   mtl = m;
 }
 
 //
@@ -164,197 +401,896 @@ static char* readstr(char* line,const char* skip)
 //
 static void LoadMaterial(const char* file)
 {
-   int k=-1;
-   char* line;
-   char* str;
+   int n=0;
+   mtl_t* m=NULL;
+   const char* line;
+   const char* s;
+   const char* w;
+   const char* p;
+   size_t len;
 
-   //  Open file or return with warning on error
-   FILE* f = fopen(file,"r");
-   if (!f)
+   //  Map file or return with warning on error
+   const char* text = (const char*)MapFile(file,&len);
+   const char* end  = text+len;
+
+   //  Remember the library so the mesh cache can tell when it changes
+   lib_t* l = (lib_t*)ArenaAlloc((Nlib+1)*sizeof(lib_t));
+   if (Nlib) memcpy(l,lib,Nlib*sizeof(lib_t));
+   lib = l;
+   l += Nlib++;
+   l->name = copyword(file,file+strlen(file));
+   if (FileStamp(file,&l->size,&l->mtime)) l->size = l->mtime = -1;
+
+   if (!text)
    {
       fprintf(stderr,"Cannot open material file %s\n",file);
       return;
    }
 
+   //  Count materials
+   for (p=text;(line=nextline(&p,end));)
+      if (readstr(line,p,"newmtl",&w)) n++;
+   MoreMaterials(n);
+
    //  Read lines
-   while ((line = readline(f)))
+   for (p=text;(line=nextline(&p,end));)
    {
+      int ok=1;
+      char err[64];
       //  New material
-      if ((str = readstr(line,"newmtl")))
-      {
-         int l = strlen(str);
-         //  Allocate memory for structure
-         k = Nmtl++;
-         mtl = (mtl_t*)realloc(mtl,Nmtl*sizeof(mtl_t));
-         //  Store name
-         mtl[k].name = (char*)malloc(l+1);
-         if (!mtl[k].name) Fatal("Cannot allocate %d for name\n",l+1);
-         strcpy(mtl[k].name,str);
-         //  Initialize materials
-         mtl[k].Ka[0] = mtl[k].Ka[1] = mtl[k].Ka[2] = 0;   mtl[k].Ka[3] = 1;
-         mtl[k].Kd[0] = mtl[k].Kd[1] = mtl[k].Kd[2] = 0;   mtl[k].Kd[3] = 1;
-         mtl[k].Ks[0] = mtl[k].Ks[1] = mtl[k].Ks[2] = 0;   mtl[k].Ks[3] = 1;
-         mtl[k].Ns  = 0;
-         mtl[k].d   = 0;
-         mtl[k].map = 0;
-      }
+      if ((s = readstr(line,p,"newmtl",&w)))
+         m = NewMaterial(s,w);
       //  If no material short circuit here
-      else if (k<0)
+      else if (!m)
       {}
       //  Ambient color
-      else if (line[0]=='K' && line[1]=='a')
-         readfloat(line+2,3,mtl[k].Ka);
+      else if (line[0]=='K' && p-line>1 && line[1]=='a')
+         ok = scanfloats(line+2,p,3,m->Ka,err,sizeof(err));
       //  Diffuse color
-      else if (line[0]=='K' && line[1] == 'd')
-         readfloat(line+2,3,mtl[k].Kd);
+      else if (line[0]=='K' && p-line>1 && line[1] == 'd')
+         ok = scanfloats(line+2,p,3,m->Kd,err,sizeof(err));
       //  Specular color
-      else if (line[0]=='K' && line[1] == 's')
-         readfloat(line+2,3,mtl[k].Ks);
+      else if (line[0]=='K' && p-line>1 && line[1] == 's')
+         ok = scanfloats(line+2,p,3,m->Ks,err,sizeof(err));
       //  Material Shininess
-      else if (line[0]=='N' && line[1]=='s')
-         readfloat(line+2,1,&mtl[k].Ns);
-      //  Textures (must be BMP - will fail if not)
-      else if ((str = readstr(line,"map_Kd")))
-         mtl[k].map = LoadTexBMP(str);
+      else if (line[0]=='N' && p-line>1 && line[1]=='s')
+         ok = scanfloats(line+2,p,1,&m->Ns,err,sizeof(err));
+      //  Textures (must be BMP - loaded when the mesh is uploaded)
+      else if ((s = readstr(line,p,"map_Kd",&w)))
+         m->map = copyword(s,w);
       //  Ignore line if we get here
+      if (!ok) Fatal("%s",err);
    }
-   fclose(f);
+   UnmapFile((void*)text,len);
 }
 
 //
-//  Set material
+//  Find material by name
+//    Returns -1 if there is no match
 //
-static void SetMaterial(const char* name)
+static int FindMaterial(const char* name)
 {
    int k;
    //  Search materials for a matching name
    for (k=0;k<Nmtl;k++)
-      if (!strcmp(mtl[k].name,name))
-      {
-         //  Set material colors
-         glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT  ,mtl[k].Ka);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE  ,mtl[k].Kd);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR ,mtl[k].Ks);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,&mtl[k].Ns);
-         //  Bind texture if specified
-         if (mtl[k].map)
-         {
-            glEnable(GL_TEXTURE_2D);
-            glBindTexture(GL_TEXTURE_2D,mtl[k].map);
-         }
-         else
-            glDisable(GL_TEXTURE_2D);
-         return;
-      }
+      if (!strcmp(mtl[k].name,name)) return k;
    //  No matches
    fprintf(stderr,"Unknown material %s\n",name);
+   return -1;
 }
 
+//  Material library or material change
+typedef struct
+{
+   int   face;   //  Facet number within the chunk
+   int   lib;    //  Material library (otherwise usemtl)
+   char* name;   //  File or material name
+} event_t;
+
+//  Line types
+enum {LINE_OTHER,LINE_VERTEX,LINE_NORMAL,LINE_TEXTURE,LINE_FACET,LINE_EVENT};
+
 //
-//  Load OBJ file
+//  Classify line [p,e)
 //
-int LoadOBJ(const char* file)
+static int linetype(const char* p,const char* e)
 {
-   int k;
-   int  Nv,Nn,Nt;  //  Number of vertex, normal and textures
-   int  Mv,Mn,Mt;  //  Maximum vertex, normal and textures
-   float* V;       //  Array of vertexes
-   float* N;       //  Array of normals
-   float* T;       //  Array if textures coordinates
-   char*  line;    //  Line pointer
-   char*  str;     //  String pointer
-
-   //  Open file
-   FILE* f = fopen(file,"r");
-   if (!f) Fatal("Cannot open file %s\n",file);
+   const char* w;
+   int n = e-p;
+   if (n>1 && p[0]=='v' && p[1]==' ')
+      return LINE_VERTEX;
+   else if (n>1 && p[0]=='v' && p[1]=='n')
+      return LINE_NORMAL;
+   else if (n>1 && p[0]=='v' && p[1]=='t')
+      return LINE_TEXTURE;
+   else if (p[0]=='f')
+      return LINE_FACET;
+   else if (readstr(p,e,"usemtl",&w) || readstr(p,e,"mtllib",&w))
+      return LINE_EVENT;
+   else
+      return LINE_OTHER;
+}
 
-   // Reset materials
-   mtl = NULL;
-   Nmtl = 0;
+//  Parser chunk
+//    Each thread counts and then parses a range of whole lines
+//    straight into its slice of the merged arrays
+typedef struct
+{
+   const char* beg;     //  Start of text
+   const char* end;     //  End of text
+   int nv,nt,nn;        //  Number of vertex, texture and normal floats
+   int nf,nc,ne,ns;     //  Number of facets, corners, events and string bytes
+   float* V;            //  Vertex coordinates
+   float* T;            //  Texture coordinates
+   float* N;            //  Normal coordinates
+   int*   F;            //  Corners in each facet
+   int*   C;            //  Vertex/Texture/Normal triplets
+   event_t* E;          //  Material events
+   char*  S;            //  Material event strings
+   int bv,bt,bn;        //  Coordinates in earlier chunks
+   char err[256];       //  First error in this chunk
+} chunk_t;
 
-   //  Start new displaylist
-   int list = glGenLists(1);
-   glNewList(list,GL_COMPILE);
-   //  Push attributes for textures
-   glPushAttrib(GL_TEXTURE_BIT);
+//
+//  Count lines, corners and strings in a chunk
+//
+static void* CountChunk(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   const char* p = c->beg;
+   const char* line;
+   while ((line=nextline(&p,c->end)))
+   {
+      int type = linetype(line,p);
+      if (type==LINE_VERTEX)
+         c->nv += 3;
+      else if (type==LINE_NORMAL)
+         c->nn += 3;
+      else if (type==LINE_TEXTURE)
+         c->nt += 2;
+      else if (type==LINE_FACET)
+      {
+         const char* q = line+1;
+         const char* w;
+         while (nextword(&q,p,&w))
+            c->nc++;
+         c->nf++;
+      }
+      else if (type==LINE_EVENT)
+      {
+         c->ne++;
+         c->ns += p-line+1;
+      }
+   }
+   return NULL;
+}
 
-   //  Read vertexes and facets
-   V  = N  = T  = NULL;
-   Nv = Nn = Nt = 0;
-   Mv = Mn = Mt = 0;
-   while ((line = readline(f)))
+//
+//  Check facet index
+//    Records the error and returns 0 if out of range
+//
+static int chunkindex(chunk_t* c,const char* what,int K,int N)
+{
+   if (K>=0 && K<=N) return 1;
+   snprintf(c->err,sizeof(c->err),"%s %d out of range 1-%d\n",what,K,N);
+   return 0;
+}
+
+//
+//  Parse range of lines
+//    Stops at the first error which is reported after all chunks finish
+//
+static void* ParseChunk(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   const char* p = c->beg;
+   const char* line;
+   char* S = c->S;
+   int kv=0,kt=0,kn=0,kf=0,kc=0,ke=0;
+
+   while ((line=nextline(&p,c->end)))
    {
+      const char* s;
+      const char* w;
+      int type = linetype(line,p);
+      int ok = 1;
       //  Vertex coordinates (always 3)
-      if (line[0]=='v' && line[1]==' ')
-         readcoord(line+2,3,&V,&Nv,&Mv);
+      if (type==LINE_VERTEX)
+      {
+         ok = scanfloats(line+2,p,3,c->V+kv,c->err,sizeof(c->err));
+         kv += 3;
+      }
       //  Normal coordinates (always 3)
-      else if (line[0]=='v' && line[1] == 'n')
-         readcoord(line+2,3,&N,&Nn,&Mn);
+      else if (type==LINE_NORMAL)
+      {
+         ok = scanfloats(line+2,p,3,c->N+kn,c->err,sizeof(c->err));
+         kn += 3;
+      }
       //  Texture coordinates (always 2)
-      else if (line[0]=='v' && line[1] == 't')
-         readcoord(line+2,2,&T,&Nt,&Mt);
-      //  Read and draw facets
-      else if (line[0]=='f')
+      else if (type==LINE_TEXTURE)
       {
-         line++;
+         ok = scanfloats(line+2,p,2,c->T+kt,c->err,sizeof(c->err));
+         kt += 2;
+      }
+      //  Read facets
+      else if (type==LINE_FACET)
+      {
+         const char* q = line+1;
+         int n=0;
+         int Nv = (c->bv+kv)/3;
+         int Nt = (c->bt+kt)/2;
+         int Nn = (c->bn+kn)/3;
          //  Read Vertex/Texture/Normal triplets
-         glBegin(GL_POLYGON);
-         while ((str = getword(&line)))
+         while ((s = nextword(&q,p,&w)))
          {
-            int Kv,Kt,Kn;
-            //  Try Vertex/Texture/Normal triplet
-            if (sscanf(str,"%d/%d/%d",&Kv,&Kt,&Kn)==3)
+            int Kv=0,Kt=0,Kn=0;
+            const char* r = s;
+            if (!scanint(&r,w,&Kv))
             {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               if (Kn<0 || Kn>Nn/3) Fatal("Normal %d out of range 1-%d\n",Kn,Nn/3);
-               if (Kt<0 || Kt>Nt/2) Fatal("Texture %d out of range 1-%d\n",Kt,Nt/2);
+               snprintf(c->err,sizeof(c->err),"Invalid facet %.*s\n",(int)(w-s),s);
+               return NULL;
             }
-            //  Try Vertex//Normal pairs
-            else if (sscanf(str,"%d//%d",&Kv,&Kn)==2)
+            //  Vertex/Texture/Normal triplet
+            else if (r<w && *r=='/' && r+1<w && r[1]!='/')
             {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               if (Kn<0 || Kn>Nn/3) Fatal("Normal %d out of range 1-%d\n",Kn,Nn/3);
-               Kt = 0;
+               const char* r1 = r+1;
+               if (scanint(&r1,w,&Kt) && r1<w && *r1=='/' && (r1++,scanint(&r1,w,&Kn)))
+                  ok = chunkindex(c,"Vertex",Kv,Nv) && chunkindex(c,"Normal",Kn,Nn) && chunkindex(c,"Texture",Kt,Nt);
+               //  Anything else is just a vertex
+               else
+               {
+                  ok = chunkindex(c,"Vertex",Kv,Nv);
+                  Kt = Kn = 0;
+               }
             }
-            //  Try Vertex index
-            else if (sscanf(str,"%d",&Kv)==1)
+            //  Vertex//Normal pair
+            else if (r+1<w && r[0]=='/' && r[1]=='/' && (r+=2,scanint(&r,w,&Kn)))
             {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               Kn = 0;
+               ok = chunkindex(c,"Vertex",Kv,Nv) && chunkindex(c,"Normal",Kn,Nn);
                Kt = 0;
             }
-            //  This is an error
+            //  Vertex index
             else
-               Fatal("Invalid facet %s\n",str);
-            //  Draw vectors
-            if (Kt) glTexCoord2fv(T+2*(Kt-1));
-            if (Kn) glNormal3fv(N+3*(Kn-1));
-            if (Kv) glVertex3fv(V+3*(Kv-1));
+            {
+               ok = chunkindex(c,"Vertex",Kv,Nv);
+               Kn = Kt = 0;
+            }
+            if (!ok) return NULL;
+            //  Save corner
+            c->C[3*kc+0] = Kv;
+            c->C[3*kc+1] = Kt;
+            c->C[3*kc+2] = Kn;
+            kc++;
+            n++;
          }
-         glEnd();
+         //  Save number of corners
+         c->F[kf++] = n;
+      }
+      //  Material change or library
+      else if (type==LINE_EVENT)
+      {
+         s = readstr(line,p,"usemtl",&w);
+         c->E[ke].lib  = !s;
+         if (!s) s = readstr(line,p,"mtllib",&w);
+         c->E[ke].face = kf;
+         c->E[ke].name = S;
+         memcpy(S,s,w-s);
+         S[w-s] = 0;
+         S += w-s+1;
+         ke++;
       }
-      //  Use material
-      else if ((str = readstr(line,"usemtl")))
-         SetMaterial(str);
-      //  Load materials
-      else if ((str = readstr(line,"mtllib")))
-         LoadMaterial(str);
       //  Skip this line
+      if (!ok) return NULL;
    }
-   fclose(f);
-   //  Pop attributes (textures)
-   glPopAttrib();
-   glEndList();
+   return NULL;
+}
+
+//
+//  Run function on every chunk with one thread per chunk
+//
+static void RunChunks(void* (*func)(void*),chunk_t* chunk,int n)
+{
+   int k;
+   pthread_t* thread = (pthread_t*)ArenaAlloc(n*sizeof(pthread_t));
+   for (k=1;k<n;k++)
+      if (pthread_create(thread+k,NULL,func,chunk+k)) Fatal("Cannot start parser thread\n");
+   func(chunk);
+   for (k=1;k<n;k++)
+      pthread_join(thread[k],NULL);
+}
+
+//
+//  Size of the vertex hash table for nc corners
+//
+static int hashsize(int nc)
+{
+   int nh;
+   for (nh=1024;nh<2*nc;nh*=2);
+   return nh;
+}
 
-   //  Free materials
+//
+//  Parse OBJ file
+//    The file is mapped and split into chunks of whole lines.
+//    A first pass counts every record so that the arena can be sized
+//    for the whole load, then each chunk parses into its own slice of
+//    the merged arrays.
+//
+static void ParseOBJ(const char* file,obj_t* m)
+{
+   int k,i,n,mat;
+   size_t len,bytes;
+   chunk_t* chunk;
+   float *V,*T,*N;
+   int *F,*C;
+   event_t* E;
+   char* S;
+   int ne=0,ns=0,nu=0;
+
+   //  Map file
+   const char* text = (const char*)MapFile(file,&len);
+   memset(m,0,sizeof(obj_t));
+   if (!text)
+   {
+      //  Empty files have no mapping
+      long long size,mtime;
+      if (FileStamp(file,&size,&mtime) || size>0) Fatal("Cannot open file %s\n",file);
+      return;
+   }
+
+   //  One chunk per core, but not less than 256K per chunk
+   n = sysconf(_SC_NPROCESSORS_ONLN);
+   if (n<1) n = 1;
+   if (n>64) n = 64;
+   if ((size_t)n > len/262144+1) n = len/262144+1;
+   chunk = (chunk_t*)ArenaAlloc(n*sizeof(chunk_t));
+   memset(chunk,0,n*sizeof(chunk_t));
+
+   //  Split on line ends
+   for (k=0;k<n;k++)
+   {
+      const char* e = text + len*(k+1)/n;
+      chunk[k].beg = k ? chunk[k-1].end : text;
+      if (e<chunk[k].beg) e = chunk[k].beg;
+      while (e<text+len && e>chunk[k].beg && !CRLF(e[-1]))
+         e++;
+      chunk[k].end = (k==n-1) ? text+len : e;
+   }
+
+   //  First pass counts records
+   RunChunks(CountChunk,chunk,n);
+   for (k=0;k<n;k++)
+   {
+      m->nv += chunk[k].nv;
+      m->nt += chunk[k].nt;
+      m->nn += chunk[k].nn;
+      m->nf += chunk[k].nf;
+      m->nc += chunk[k].nc;
+      ne += chunk[k].ne;
+      ns += chunk[k].ns;
+   }
+
+   //  Reserve the arena for the parsed arrays and the packed mesh
+   bytes = sizeof(float)*((size_t)m->nv+m->nt+m->nn)            //  Coordinates
+         + sizeof(int)*((size_t)m->nf+3*m->nc+2*ne)             //  Facets, corners and material changes
+         + sizeof(event_t)*ne + ns                              //  Material events
+         + sizeof(float)*VSTRIDE*((size_t)m->nc+1)              //  Packed vertexes
+         + sizeof(unsigned int)*(3*(size_t)m->nc+1)             //  Packed indexes
+         + sizeof(int)*((size_t)hashsize(m->nc)+3*m->nc+m->nf)  //  Packer tables
+         + 16*16;                                               //  Alignment
+   ArenaReserve(bytes);
+   V = m->V = (float*)ArenaAlloc((m->nv+1)*sizeof(float));
+   T = m->T = (float*)ArenaAlloc((m->nt+1)*sizeof(float));
+   N = m->N = (float*)ArenaAlloc((m->nn+1)*sizeof(float));
+   F = m->F = (int*)ArenaAlloc((m->nf+1)*sizeof(int));
+   C = m->C = (int*)ArenaAlloc((3*m->nc+1)*sizeof(int));
+   E = (event_t*)ArenaAlloc((ne+1)*sizeof(event_t));
+   S = (char*)ArenaAlloc(ns+1);
+   m->U = (int*)ArenaAlloc((2*ne+1)*sizeof(int));
+
+   //  Hand out slices in file order
+   for (k=0;k<n;k++)
+   {
+      chunk_t* c = chunk+k;
+      c->V = V;  c->bv = V-m->V;  V += c->nv;
+      c->T = T;  c->bt = T-m->T;  T += c->nt;
+      c->N = N;  c->bn = N-m->N;  N += c->nn;
+      c->F = F;  F += c->nf;
+      c->C = C;  C += 3*c->nc;
+      c->E = E;  E += c->ne;
+      c->S = S;  S += c->ns;
+   }
+
+   //  Second pass parses records
+   RunChunks(ParseChunk,chunk,n);
+
+   //  Report the first error in file order
+   for (k=0;k<n;k++)
+      if (chunk[k].err[0]) Fatal("%s",chunk[k].err);
+
+   //  Materials are loaded and looked up in file order
+   //    An unknown material keeps the one before it
+   for (k=0,i=0,mat=-1;k<n;i+=chunk[k++].nf)
+   {
+      int j;
+      for (j=0;j<chunk[k].ne;j++)
+      {
+         event_t* ev = chunk[k].E+j;
+         if (ev->lib)
+            LoadMaterial(ev->name);
+         else
+         {
+            int K = FindMaterial(ev->name);
+            if (K>=0) mat = K;
+            m->U[2*nu+0] = i + ev->face;
+            m->U[2*nu+1] = mat;
+            nu++;
+         }
+      }
+   }
+   m->nu = nu;
+   UnmapFile((void*)text,len);
+
+   //  Convert float counts to coordinate counts
+   m->nv /= 3;
+   m->nt /= 2;
+   m->nn /= 3;
+}
+
+//
+//  Unit normal of a facet with n corners
+//    Newell's method so polygons that are not quite flat still work
+//
+static void FacetNormal(obj_t* o,const int* C,int n,float* N)
+{
+   int i;
+   float len;
+   const float zero[3] = {0,0,0};  //  Corners without a vertex are at the origin
+   N[0] = N[1] = N[2] = 0;
+   for (i=0;i<n;i++)
+   {
+      int Kp = C[3*i], Kq = C[3*((i+1)%n)];
+      const float* p = Kp ? o->V+3*(Kp-1) : zero;
+      const float* q = Kq ? o->V+3*(Kq-1) : zero;
+      N[0] += (p[1]-q[1])*(p[2]+q[2]);
+      N[1] += (p[2]-q[2])*(p[0]+q[0]);
+      N[2] += (p[0]-q[0])*(p[1]+q[1]);
+   }
+   len = sqrt(N[0]*N[0]+N[1]*N[1]+N[2]*N[2]);
+   if (len>0)
+      for (i=0;i<3;i++)
+         N[i] /= len;
+}
+
+//
+//  Pack parsed OBJ into a mesh
+//    Triplets are merged using an open addressing hash table
+//    Corners without a normal get the normal of their facet and are
+//    not merged since the facets around them need different normals
+//    Polygons are split into triangle fans
+//
+static void PackOBJ(obj_t* o,mesh_t* m)
+{
+   int k,i,c,u;
+   int nh;             //  Hash table size
+   int* hash;          //  Hash table of vertex numbers (-1 for empty)
+   int* fm;            //  Material for each facet
+   int* cv;            //  Vertex number for each corner
+   int* fc;            //  First corner for each vertex
+   int* cnt;           //  Index count per material
+   int* pos;           //  Next index per material
+
+   //  Material of each facet (material -1 is stored in slot 0)
+   fm  = (int*)ArenaAlloc((o->nf+1)*sizeof(int));
+   cv  = (int*)ArenaAlloc((o->nc+1)*sizeof(int));
+   fc  = (int*)ArenaAlloc((o->nc+1)*sizeof(int));
+   cnt = (int*)ArenaAlloc((Nmtl+1)*sizeof(int));
+   pos = (int*)ArenaAlloc((Nmtl+1)*sizeof(int));
+   nh  = hashsize(o->nc);
+   hash = (int*)ArenaAlloc(nh*sizeof(int));
+   m->V = (float*)ArenaAlloc((o->nc+1)*VSTRIDE*sizeof(float));
+   memset(cnt,0,(Nmtl+1)*sizeof(int));
+   for (k=0;k<nh;k++)
+      hash[k] = -1;
+
+   //  Merge corners into unique vertexes
+   m->nv = 0;
+   for (k=0,c=0;k<o->nf;k++)
+   {
+      int fn=0;     //  Facet normal found
+      float N[3];   //  Facet normal
+      for (i=0;i<o->F[k];i++,c++)
+      {
+         int* K = o->C+3*c;
+         float* v = m->V+VSTRIDE*m->nv;
+         //  Facet normal for a corner without one
+         if (!K[2])
+         {
+            if (!fn) FacetNormal(o,o->C+3*(c-i),o->F[k],N);
+            fn = 1;
+            memset(v,0,VSTRIDE*sizeof(float));
+            if (K[0]) memcpy(v+0,o->V+3*(K[0]-1),3*sizeof(float));
+            memcpy(v+3,N,3*sizeof(float));
+            if (K[1]) memcpy(v+6,o->T+2*(K[1]-1),2*sizeof(float));
+            cv[c] = m->nv++;
+         }
+         //  Merge with a matching triplet
+         else
+         {
+            unsigned int h = (K[0]*73856093u ^ K[1]*19349663u ^ K[2]*83492791u) & (nh-1);
+            while (hash[h]>=0 && memcmp(o->C+3*fc[hash[h]],K,3*sizeof(int)))
+               h = (h+1) & (nh-1);
+            if (hash[h]<0)
+            {
+               memset(v,0,VSTRIDE*sizeof(float));
+               if (K[0]) memcpy(v+0,o->V+3*(K[0]-1),3*sizeof(float));
+               memcpy(v+3,o->N+3*(K[2]-1),3*sizeof(float));
+               if (K[1]) memcpy(v+6,o->T+2*(K[1]-1),2*sizeof(float));
+               //  Remember the corner that produced this vertex
+               fc[m->nv] = c;
+               hash[h] = m->nv++;
+            }
+            cv[c] = hash[h];
+         }
+      }
+   }
+
+   //  Count triangles per material
+   for (k=0,u=0;k<o->nf;k++)
+   {
+      for (;u<o->nu && o->U[2*u]<=k;u++);
+      fm[k] = u ? o->U[2*u-1]+1 : 0;
+      if (o->F[k]>2) cnt[fm[k]] += 3*(o->F[k]-2);
+   }
+   //  Material ranges in order of material
+   m->R = (int*)ArenaAlloc(3*(Nmtl+1)*sizeof(int));
+   m->nr = m->ni = 0;
+   for (k=0;k<=Nmtl;k++)
+   {
+      pos[k] = m->ni;
+      if (!cnt[k]) continue;
+      m->R[3*m->nr+0] = k-1;
+      m->R[3*m->nr+1] = m->ni;
+      m->R[3*m->nr+2] = cnt[k];
+      m->nr++;
+      m->ni += cnt[k];
+   }
+   //  Triangle fans
+   m->I = (unsigned int*)ArenaAlloc((m->ni+1)*sizeof(unsigned int));
+   for (k=0,c=0;k<o->nf;c+=o->F[k++])
+      for (i=2;i<o->F[k];i++)
+      {
+         m->I[pos[fm[k]]++] = cv[c];
+         m->I[pos[fm[k]]++] = cv[c+i-1];
+         m->I[pos[fm[k]]++] = cv[c+i];
+      }
+}
+
+//
+//  Check that every offset and index in a mapped cache stays inside it
+//    Returns 0 if the cache can be used
+//
+static int CheckCache(cache_t* h,clib_t* cl,mesh_t* m,cmtl_t* cm,char* str)
+{
+   int k;
+   //  Strings must end inside the table
+   if (h->ns<0 || (h->ns>0 && str[h->ns-1])) return 1;
+   for (k=0;k<h->nl;k++)
+      if (cl[k].name<0 || cl[k].name>=h->ns) return 1;
+   for (k=0;k<h->nm;k++)
+      if (cm[k].name<0 || cm[k].name>=h->ns || cm[k].map<-1 || cm[k].map>=h->ns) return 1;
+   //  Ranges must use a known material and stay inside the indexes
+   for (k=0;k<m->nr;k++)
+   {
+      int K=m->R[3*k],first=m->R[3*k+1],count=m->R[3*k+2];
+      if (K<-1 || K>=h->nm || first<0 || count<0 || first>m->ni-count) return 1;
+   }
+   //  Indexes must refer to a vertex
+   for (k=0;k<m->ni;k++)
+      if (m->I[k]>=(unsigned int)m->nv) return 1;
+   return 0;
+}
+
+//
+//  Map mesh cache
+//    Returns the mapping if the cache matches the OBJ and material
+//    library sizes and times
+//
+static void* ReadCache(const char* cache,long long size,long long mtime,mesh_t* m,size_t* len)
+{
+   int k;
+   cache_t* h;
+   clib_t*  cl;
+   cmtl_t*  cm;
+   char*    str;
+   size_t   n;
+   //  Map file
+   char* map = (char*)MapFile(cache,len);
+   if (!map) return NULL;
+   //  Check header
+   h = (cache_t*)map;
+   if (*len<sizeof(cache_t) || memcmp(h->magic,"OBJC",4) || h->version!=CACHE_VERSION ||
+       h->size!=size || h->mtime!=mtime)
+   {
+      UnmapFile(map,*len);
+      return NULL;
+   }
+   //  Check size
+   n = sizeof(cache_t) + sizeof(clib_t)*(size_t)h->nl + sizeof(float)*VSTRIDE*(size_t)h->nv
+     + sizeof(unsigned int)*(size_t)h->ni + sizeof(int)*3*(size_t)h->nr + sizeof(cmtl_t)*(size_t)h->nm + h->ns;
+   if (h->nl<0 || h->nv<0 || h->ni<0 || h->nr<0 || h->nm<0 || h->ns<0 || n!=*len)
+   {
+      fprintf(stderr,"Ignoring corrupt mesh cache %s\n",cache);
+      UnmapFile(map,*len);
+      return NULL;
+   }
+   //  Point arrays into the mapping
+   m->nv = h->nv;
+   m->ni = h->ni;
+   m->nr = h->nr;
+   cl   = (clib_t*)(h+1);
+   m->V = (float*)(cl + h->nl);
+   m->I = (unsigned int*)(m->V + VSTRIDE*m->nv);
+   m->R = (int*)(m->I + m->ni);
+   cm   = (cmtl_t*)(m->R + 3*m->nr);
+   str  = (char*)(cm + h->nm);
+   //  Check contents
+   if (CheckCache(h,cl,m,cm,str))
+   {
+      fprintf(stderr,"Ignoring corrupt mesh cache %s\n",cache);
+      UnmapFile(map,*len);
+      return NULL;
+   }
+   //  Check material libraries
+   for (k=0;k<h->nl;k++)
+   {
+      long long lsize,lmtime;
+      if (FileStamp(str+cl[k].name,&lsize,&lmtime)) lsize = lmtime = -1;
+      if (lsize!=cl[k].size || lmtime!=cl[k].mtime)
+      {
+         UnmapFile(map,*len);
+         return NULL;
+      }
+   }
+   //  Copy materials
+   MoreMaterials(h->nm);
+   for (k=0;k<h->nm;k++)
+   {
+      const char* name = str+cm[k].name;
+      mtl_t* M = NewMaterial(name,name+strlen(name));
+      memcpy(M->Ka,cm[k].Ka,sizeof(M->Ka));
+      memcpy(M->Kd,cm[k].Kd,sizeof(M->Kd));
+      memcpy(M->Ks,cm[k].Ks,sizeof(M->Ks));
+      M->Ns = cm[k].Ns;
+      M->d  = cm[k].d;
+      if (cm[k].map>=0) M->map = copyword(str+cm[k].map,str+cm[k].map+strlen(str+cm[k].map));
+   }
+   return map;
+}
+
+//
+//  Save mesh cache
+//    Failure only costs parsing the OBJ again next time
+//
+static void WriteCache(const char* cache,long long size,long long mtime,mesh_t* m)
+{
+   int k;
+   cache_t h;
+   char tmp[strlen(cache)+5];
+   FILE* f;
+
+   //  Header
+   memset(&h,0,sizeof(h));
+   memcpy(h.magic,"OBJC",4);
+   h.version = CACHE_VERSION;
+   h.size  = size;
+   h.mtime = mtime;
+   h.nv = m->nv;
+   h.ni = m->ni;
+   h.nr = m->nr;
+   h.nm = Nmtl;
+   h.nl = Nlib;
+   h.ns = 0;
+   for (k=0;k<Nlib;k++)
+      h.ns += strlen(lib[k].name)+1;
    for (k=0;k<Nmtl;k++)
-      free(mtl[k].name);
-   free(mtl);
+      h.ns += strlen(mtl[k].name)+1 + (mtl[k].map ? strlen(mtl[k].map)+1 : 0);
 
-   //  Free arrays
-   free(V);
-   free(T);
-   free(N);
+   //  Write to a temporary file and rename so a partial cache is never seen
+   sprintf(tmp,"%s.tmp",cache);
+   f = fopen(tmp,"wb");
+   if (!f)
+   {
+      fprintf(stderr,"Cannot write mesh cache %s\n",cache);
+      return;
+   }
+   fwrite(&h,sizeof(h),1,f);
+   //  Libraries and materials refer to the string table by offset
+   for (k=0,h.ns=0;k<Nlib;k++)
+   {
+      clib_t cl;
+      cl.name  = h.ns;
+      cl.pad   = 0;
+      cl.size  = lib[k].size;
+      cl.mtime = lib[k].mtime;
+      h.ns += strlen(lib[k].name)+1;
+      fwrite(&cl,sizeof(cl),1,f);
+   }
+   fwrite(m->V,sizeof(float),VSTRIDE*m->nv,f);
+   fwrite(m->I,sizeof(unsigned int),m->ni,f);
+   fwrite(m->R,sizeof(int),3*m->nr,f);
+   for (k=0;k<Nmtl;k++)
+   {
+      cmtl_t cm;
+      memcpy(cm.Ka,mtl[k].Ka,sizeof(cm.Ka));
+      memcpy(cm.Kd,mtl[k].Kd,sizeof(cm.Kd));
+      memcpy(cm.Ks,mtl[k].Ks,sizeof(cm.Ks));
+      cm.Ns = mtl[k].Ns;
+      cm.d  = mtl[k].d;
+      cm.name = h.ns;
+      h.ns += strlen(mtl[k].name)+1;
+      cm.map = mtl[k].map ? h.ns : -1;
+      if (mtl[k].map) h.ns += strlen(mtl[k].map)+1;
+      fwrite(&cm,sizeof(cm),1,f);
+   }
+   for (k=0;k<Nlib;k++)
+      fwrite(lib[k].name,strlen(lib[k].name)+1,1,f);
+   for (k=0;k<Nmtl;k++)
+   {
+      fwrite(mtl[k].name,strlen(mtl[k].name)+1,1,f);
+      if (mtl[k].map) fwrite(mtl[k].map,strlen(mtl[k].map)+1,1,f);
+   }
+   k = ferror(f);
+   if (fclose(f) || k || rename(tmp,cache))
+   {
+      fprintf(stderr,"Cannot write mesh cache %s\n",cache);
+      remove(tmp);
+   }
+}
+
+//
+//  Upload mesh to vertex and index buffers
+//
+static void UploadOBJ(mesh_t* m,model_t* obj)
+{
+   int k;
+
+   //  Load textures
+   for (k=0;k<Nmtl;k++)
+      if (mtl[k].map) mtl[k].tex = LoadTexBMPAsync(mtl[k].map,1);
+
+   //  Copy material ranges
+   obj->nr = m->nr;
+   obj->R = (range_t*)malloc((m->nr+1)*sizeof(range_t));
+   if (!obj->R) Fatal("Cannot allocate memory for materials\n");
+   for (k=0;k<m->nr;k++)
+   {
+      range_t* r = obj->R+k;
+      int K = m->R[3*k];
+      r->set = K>=0;
+      if (r->set)
+      {
+         memcpy(r->Ka,mtl[K].Ka,sizeof(r->Ka));
+         memcpy(r->Kd,mtl[K].Kd,sizeof(r->Kd));
+         memcpy(r->Ks,mtl[K].Ks,sizeof(r->Ks));
+         r->Ns  = mtl[K].Ns;
+         r->tex = mtl[K].tex;
+      }
+      r->first = m->R[3*k+1];
+      r->count = m->R[3*k+2];
+   }
 
-   return list;
+   //  Vertex buffer
+   glGenBuffers(1,&obj->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,obj->vbo);
+   glBufferData(GL_ARRAY_BUFFER,VSTRIDE*sizeof(float)*m->nv,m->V,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   //  Index buffer
+   glGenBuffers(1,&obj->ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,obj->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(unsigned int)*m->ni,m->I,GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   ErrCheck("LoadOBJ");
+}
+
+//
+//  Load OBJ file
+//    The packed mesh is cached in file.mesh
+//    Returns model number for DrawOBJ
+//
+int LoadOBJ(const char* file)
+{
+   long long size,mtime;  //  OBJ file stamp
+   mesh_t mesh;           //  Packed mesh
+   void*  map;            //  Mapped cache
+   size_t len;            //  Length of mapped cache
+   char cache[strlen(file)+6];
+
+   //  Check file
+   if (FileStamp(file,&size,&mtime)) Fatal("Cannot open file %s\n",file);
+   sprintf(cache,"%s.mesh",file);
+
+   // Reset materials
+   mtl = NULL;
+   Nmtl = 0;
+   lib = NULL;
+   Nlib = 0;
+
+   //  Use cache if current otherwise parse, pack and save
+   map = ReadCache(cache,size,mtime,&mesh,&len);
+   if (!map)
+   {
+      obj_t obj;
+      ParseOBJ(file,&obj);
+      PackOBJ(&obj,&mesh);
+      WriteCache(cache,size,mtime,&mesh);
+   }
+
+   //  Upload
+   model = (model_t*)realloc(model,(Nmodel+1)*sizeof(model_t));
+   if (!model) Fatal("Cannot allocate memory for model %s\n",file);
+   UploadOBJ(&mesh,model+Nmodel);
+
+   //  Release the cache and everything allocated while loading
+   UnmapFile(map,len);
+   ArenaFree();
+   mtl = NULL;
+   Nmtl = 0;
+   lib = NULL;
+   Nlib = 0;
+
+   //  Model numbers start at 1
+   return ++Nmodel;
+}
+
+//
+//  Draw model loaded with LoadOBJ
+//    One glDrawElements per material
+//
+void DrawOBJ(int obj)
+{
+   int k;
+   model_t* m;
+   if (obj<1 || obj>Nmodel) return;
+   m = model+obj-1;
+
+   //  Push attributes for textures and arrays
+   glPushAttrib(GL_TEXTURE_BIT);
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   //  Interleaved arrays
+   glBindBuffer(GL_ARRAY_BUFFER,m->vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,m->ibo);
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glVertexPointer(3,GL_FLOAT,VSTRIDE*sizeof(float),(void*)(0*sizeof(float)));
+   glNormalPointer(GL_FLOAT,VSTRIDE*sizeof(float),(void*)(3*sizeof(float)));
+   glTexCoordPointer(2,GL_FLOAT,VSTRIDE*sizeof(float),(void*)(6*sizeof(float)));
+   //  Draw material ranges
+   for (k=0;k<m->nr;k++)
+   {
+      range_t* r = m->R+k;
+      if (r->set)
+      {
+         //  Set material colors
+         glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT  ,r->Ka);
+         glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE  ,r->Kd);
+         glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR ,r->Ks);
+         glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,&r->Ns);
+         //  Bind texture if specified
+         if (r->tex)
+         {
+            glEnable(GL_TEXTURE_2D);
+            glBindTexture(GL_TEXTURE_2D,r->tex);
+         }
+         else
+            glDisable(GL_TEXTURE_2D);
+      }
+      glDrawElements(GL_TRIANGLES,r->count,GL_UNSIGNED_INT,(void*)(r->first*sizeof(unsigned int)));
+   }
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   //  Pop attributes
+   glPopClientAttrib();
+   glPopAttrib();
 }
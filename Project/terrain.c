@@ -0,0 +1,478 @@
+/*
+ *  Terrain meshes built from heightfields
+ *
+ *  LoadTerrain cuts a heightfield into a quadtree of chunks.  Every chunk is
+ *  a CHUNK x CHUNK grid of cells: the leaves sample the heightfield at full
+ *  resolution and each level up samples every other point of the level
+ *  below, so one chunk covers four times the area at half the detail.  All
+ *  chunks share one index buffer holding a single triangle strip, so a
+ *  chunk is drawn with one glDrawElements from its place in the vertex
+ *  buffer.
+ *
+ *  Each chunk knows the largest height error it makes against the full
+ *  heightfield.  DrawTerrain walks the tree from the root, skips chunks
+ *  outside the view frustum, and stops at the first chunk whose error
+ *  projects to no more than TerrainError pixels on the screen.  Neighbours
+ *  can end up at different levels, so every chunk hangs a skirt down from
+ *  its edges, deep enough to hide the cracks between them.
+ *
+ *  BuildTerrain does all the work of cutting up the heightfield without
+ *  touching OpenGL, so it can run on a loader thread, and UploadTerrain
+ *  copies the result into a vertex buffer.  LoadTerrain does both.
+ *
+ *  The terrain is centered on the origin in x and y with heights measured
+ *  from the middle of the height range.  Normals are those of the unscaled
+ *  surface, which stay correct under glScale in z as long as GL_NORMALIZE
+ *  is enabled, so one mesh serves every height magnification.  Texture
+ *  coordinates are generated from the position to cover the whole terrain
+ *  once.
+ */
+#include "CSCIx229.h"
+#include "terrain.h"
+
+//  Cells along the side of a chunk
+#define CHUNK 16
+//  Vertexes in a chunk (grid then the bottom of the skirt)
+#define CHUNK_VERTS ((CHUNK+1)*(CHUNK+1)+4*CHUNK)
+
+//  Vertex with a normal packed into bytes
+typedef struct
+{
+   float       x,y,z;  //  Position
+   signed char n[4];   //  Normal (fourth byte unused)
+} vertex_t;
+
+//  Quadtree node
+typedef struct
+{
+   int   x0,y0;        //  First sample
+   int   step;         //  Samples between vertexes
+   int   child[4];     //  Children (-1 for none)
+   int   first;        //  First vertex in the vertex buffer
+   float error;        //  Largest height error of this chunk or any below it
+   float lo[3],hi[3];  //  Bounding box
+} node_t;
+
+//  Terrain built but not yet uploaded
+struct TerrainMesh
+{
+   int nn;                //  Number of nodes
+   node_t* node;          //  Nodes (root first)
+   vertex_t* vert;        //  Vertexes of every chunk
+   float w,h;             //  Width and depth
+};
+
+//  Uploaded terrain
+typedef struct
+{
+   unsigned int vbo;      //  Vertex buffer (0 for a free slot)
+   int nn;                //  Number of nodes
+   node_t* node;          //  Nodes (root first)
+   float w,h;             //  Width and depth
+} terrain_t;
+
+//  Terrain count and array
+static int Nterrain=0;
+static terrain_t* terrain=NULL;
+//  Index buffer and indexes in the chunk strip
+static unsigned int ibo=0;
+static int Nindex=0;
+//  Screen space error allowed in pixels
+static double maxError=2;
+
+/*
+ *  Height of sample i,j, repeating the edge beyond the grid
+ */
+static float Height(const HeightField* H,int i,int j)
+{
+   if (i>H->nx-1) i = H->nx-1;
+   if (j>H->ny-1) j = H->ny-1;
+   return H->z[(size_t)j*H->nx+i];
+}
+
+/*
+ *  Largest difference between the heightfield and a chunk sampling every
+ *  step samples, checking every sample the chunk covers
+ */
+static float ChunkError(const HeightField* H,int x0,int y0,int step)
+{
+   int   i,j;
+   float err=0;
+   for (j=y0;j<=y0+CHUNK*step && j<H->ny;j++)
+      for (i=x0;i<=x0+CHUNK*step && i<H->nx;i++)
+      {
+         //  Cell and position in it
+         int   ci = x0+(i-x0)/step*step, cj = y0+(j-y0)/step*step;
+         float u = (float)(i-ci)/step, v = (float)(j-cj)/step;
+         float h00 = Height(H,ci,cj), h10 = Height(H,ci+step,cj);
+         float h01 = Height(H,ci,cj+step), h11 = Height(H,ci+step,cj+step);
+         //  Cells are split along the diagonal from (0,0) to (1,1)
+         float h = (v>=u) ? h00 + v*(h01-h00) + u*(h11-h01) : h00 + u*(h10-h00) + v*(h11-h10);
+         float d = fabs(h-Height(H,i,j));
+         if (d>err) err = d;
+      }
+   return err;
+}
+
+/*
+ *  Build the quadtree below a chunk
+ *    Returns the node or -1 if the chunk is off the grid
+ */
+static int Build(TerrainMesh* t,const HeightField* H,int x0,int y0,int step)
+{
+   int i,j,k;
+   node_t* n;
+   float zlo,zhi;
+   if (x0>=H->nx-1 || y0>=H->ny-1) return -1;
+   //  New node
+   k = t->nn++;
+   t->node = (node_t*)realloc(t->node,t->nn*sizeof(node_t));
+   if (!t->node) Fatal("Cannot allocate memory for terrain\n");
+   n = t->node+k;
+   n->x0 = x0;
+   n->y0 = y0;
+   n->step = step;
+   n->first = k*CHUNK_VERTS;
+   n->error = (step>1) ? ChunkError(H,x0,y0,step) : 0;
+   //  Children with half the step (nodes may move as the array grows)
+   for (i=0;i<4;i++)
+   {
+      int c = (step>1) ? Build(t,H,x0+(i%2)*CHUNK*step/2,y0+(i/2)*CHUNK*step/2,step/2) : -1;
+      n = t->node+k;
+      n->child[i] = c;
+      //  Never finer than a chunk below
+      if (c>=0 && t->node[c].error>n->error) n->error = t->node[c].error;
+   }
+   //  Height range covered
+   zlo = zhi = Height(H,x0,y0);
+   for (j=y0;j<=y0+CHUNK*step && j<H->ny;j++)
+      for (i=x0;i<=x0+CHUNK*step && i<H->nx;i++)
+      {
+         float z = Height(H,i,j);
+         if (z<zlo) zlo = z;
+         if (z>zhi) zhi = z;
+      }
+   //  Box around the chunk (the skirt is added later)
+   n->lo[0] = H->dx*x0 - t->w/2;
+   n->lo[1] = H->dy*y0 - t->h/2;
+   n->lo[2] = zlo - (H->zmin+H->zmax)/2;
+   n->hi[0] = H->dx*(x0+CHUNK*step<H->nx ? x0+CHUNK*step : H->nx-1) - t->w/2;
+   n->hi[1] = H->dy*(y0+CHUNK*step<H->ny ? y0+CHUNK*step : H->ny-1) - t->h/2;
+   n->hi[2] = zhi - (H->zmin+H->zmax)/2;
+   return k;
+}
+
+/*
+ *  Fill the vertexes of a chunk and the chunks below it
+ *    The skirt hangs down far enough to cover a neighbour with the error of
+ *    the parent, which is at least that of any chunk that can sit next to it
+ */
+static void Vertexes(TerrainMesh* t,const HeightField* H,float margin,int k,float skirt)
+{
+   int i,j,m;
+   node_t* n = t->node+k;
+   vertex_t* V = t->vert+n->first;
+   double z0 = (H->zmin+H->zmax)/2;
+   //  Grid
+   for (j=0;j<=CHUNK;j++)
+      for (i=0;i<=CHUNK;i++)
+      {
+         vertex_t* v = V+j*(CHUNK+1)+i;
+         //  Points off the grid fold back onto its edge
+         int x = n->x0+i*n->step < H->nx ? n->x0+i*n->step : H->nx-1;
+         int y = n->y0+j*n->step < H->ny ? n->y0+j*n->step : H->ny-1;
+         v->x = H->dx*x - t->w/2;
+         v->y = H->dy*y - t->h/2;
+         v->z = Height(H,x,y) - z0;
+         //  Smooth normal of the full heightfield
+         memcpy(v->n,H->n+4*((size_t)y*H->nx+x),4);
+      }
+   //  Skirt around the edge, in the same order as the strip
+   for (m=0;m<4*CHUNK;m++)
+   {
+      int e = m/CHUNK, p = m%CHUNK;
+      int i = (e==0) ? p : (e==1) ? CHUNK : (e==2) ? CHUNK-p : 0;
+      int j = (e==0) ? 0 : (e==1) ? p : (e==2) ? CHUNK : CHUNK-p;
+      vertex_t* v = V+(CHUNK+1)*(CHUNK+1)+m;
+      *v = V[j*(CHUNK+1)+i];
+      v->z -= skirt;
+   }
+   //  Grow the box down to the skirt
+   n->lo[2] -= skirt;
+   //  Children
+   for (i=0;i<4;i++)
+      if (n->child[i]>=0) Vertexes(t,H,margin,n->child[i],n->error+margin);
+}
+
+/*
+ *  Index buffer shared by every chunk
+ *    The grid as one strip joined by degenerate triangles to a band
+ *    around the edge down to the skirt
+ */
+static void ChunkIndexes(void)
+{
+   int i,j,k=0;
+   unsigned short* I;
+   Nindex = 2*(CHUNK+1)*CHUNK + 2*(CHUNK-1) + 2 + 2*(4*CHUNK+1);
+   I = (unsigned short*)malloc(Nindex*sizeof(unsigned short));
+   if (!I) Fatal("Cannot allocate memory for terrain\n");
+   //  Strip up each row of cells, counter clockwise seen from above
+   for (j=0;j<CHUNK;j++)
+   {
+      //  Repeat the last index and the next one to jump to the new row
+      if (j>0)
+      {
+         I[k] = I[k-1];
+         k++;
+         I[k++] = (j+1)*(CHUNK+1);
+      }
+      for (i=0;i<=CHUNK;i++)
+      {
+         I[k++] = (j+1)*(CHUNK+1)+i;
+         I[k++] = j*(CHUNK+1)+i;
+      }
+   }
+   //  Jump to the skirt
+   I[k] = I[k-1];
+   k++;
+   I[k++] = 0;
+   //  Band between the edge and the skirt all the way round
+   for (i=0;i<=4*CHUNK;i++)
+   {
+      int m = i%(4*CHUNK), e = m/CHUNK, p = m%CHUNK;
+      int x = (e==0) ? p : (e==1) ? CHUNK : (e==2) ? CHUNK-p : 0;
+      int y = (e==0) ? 0 : (e==1) ? p : (e==2) ? CHUNK : CHUNK-p;
+      I[k++] = y*(CHUNK+1)+x;
+      I[k++] = (CHUNK+1)*(CHUNK+1)+m;
+   }
+   glGenBuffers(1,&ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,Nindex*sizeof(unsigned short),I,GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   free(I);
+}
+
+/*
+ *  Build terrain from a heightfield without using OpenGL
+ *    Safe to call from any thread
+ *    Returns the mesh for UploadTerrain
+ */
+TerrainMesh* BuildTerrain(const HeightField* hf)
+{
+   int size=CHUNK,step=1;
+   float margin = 0.01*(hf->zmax-hf->zmin);
+   TerrainMesh* t = (TerrainMesh*)malloc(sizeof(TerrainMesh));
+   if (!t) Fatal("Cannot allocate memory for terrain\n");
+   t->nn = 0;
+   t->node = NULL;
+   t->w = hf->dx*(hf->nx-1);
+   t->h = hf->dy*(hf->ny-1);
+   //  Root chunk covers the grid
+   while (size<hf->nx-1 || size<hf->ny-1)
+   {
+      size *= 2;
+      step *= 2;
+   }
+   Build(t,hf,0,0,step);
+   //  Vertexes of every chunk
+   t->vert = (vertex_t*)malloc((size_t)t->nn*CHUNK_VERTS*sizeof(vertex_t));
+   if (!t->vert) Fatal("Cannot allocate memory for terrain\n");
+   Vertexes(t,hf,margin,0,t->node[0].error+margin);
+   return t;
+}
+
+/*
+ *  Discard a mesh that was never uploaded
+ */
+void FreeTerrainMesh(TerrainMesh* mesh)
+{
+   free(mesh->node);
+   free(mesh->vert);
+   free(mesh);
+}
+
+/*
+ *  Copy a mesh into a vertex buffer
+ *    The mesh is freed
+ *    Returns terrain number for DrawTerrain
+ */
+int UploadTerrain(TerrainMesh* mesh)
+{
+   int k;
+   terrain_t* t;
+   //  Reuse a free slot
+   for (k=0;k<Nterrain && terrain[k].vbo;k++);
+   if (k==Nterrain)
+   {
+      terrain = (terrain_t*)realloc(terrain,(Nterrain+1)*sizeof(terrain_t));
+      if (!terrain) Fatal("Cannot allocate memory for terrain\n");
+      Nterrain++;
+   }
+   t = terrain+k;
+   t->nn = mesh->nn;
+   t->node = mesh->node;
+   t->w = mesh->w;
+   t->h = mesh->h;
+   //  Vertexes of every chunk
+   glGenBuffers(1,&t->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,t->vbo);
+   glBufferData(GL_ARRAY_BUFFER,(size_t)t->nn*CHUNK_VERTS*sizeof(vertex_t),mesh->vert,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   free(mesh->vert);
+   free(mesh);
+   //  Indexes are the same for every chunk of every terrain
+   if (!ibo) ChunkIndexes();
+   ErrCheck("UploadTerrain");
+   return k+1;
+}
+
+/*
+ *  Load terrain from a heightfield
+ *    Returns terrain number for DrawTerrain
+ */
+int LoadTerrain(const HeightField* hf)
+{
+   return UploadTerrain(BuildTerrain(hf));
+}
+
+/*
+ *  Bytes of vertex buffer held by a terrain
+ */
+long long TerrainBytes(int ter)
+{
+   if (ter<1 || ter>Nterrain || !terrain[ter-1].vbo) return 0;
+   return (long long)terrain[ter-1].nn*CHUNK_VERTS*sizeof(vertex_t);
+}
+
+/*
+ *  Release a terrain
+ *    The number may be handed out again by a later load
+ */
+void FreeTerrain(int ter)
+{
+   terrain_t* t;
+   if (ter<1 || ter>Nterrain || !terrain[ter-1].vbo) return;
+   t = terrain+ter-1;
+   glDeleteBuffers(1,&t->vbo);
+   free(t->node);
+   t->vbo = 0;
+   t->node = NULL;
+   t->nn = 0;
+}
+
+/*
+ *  Set the screen space error allowed in pixels
+ */
+void TerrainError(double pixels)
+{
+   maxError = pixels;
+}
+
+//  View of the terrain being drawn
+static double M[16];         //  Modelview matrix
+static double F[6][4];       //  Frustum planes in terrain coordinates
+static double Kpix;          //  Pixels per unit at unit distance
+static int    ortho;         //  Orthogonal projection
+static double Zscale;        //  Length of a unit of height in eye coordinates
+static double Cam[3];        //  Eye in terrain coordinates
+
+/*
+ *  Draw the chunks below a node that are needed for the current view
+ *    Returns the number of triangles
+ */
+static int DrawNode(terrain_t* t,int k)
+{
+   int i,tri=0;
+   double q[3],e[3],d,sse;
+   node_t* n = t->node+k;
+   //  Skip chunks with the corner furthest inside a clip plane still outside it
+   for (i=0;i<6;i++)
+      if (F[i][0]*(F[i][0]>0 ? n->hi[0] : n->lo[0]) + F[i][1]*(F[i][1]>0 ? n->hi[1] : n->lo[1]) +
+          F[i][2]*(F[i][2]>0 ? n->hi[2] : n->lo[2]) + F[i][3] < 0)
+         return 0;
+   //  Error on the screen from the point of the chunk nearest the eye
+   for (i=0;i<3;i++)
+      q[i] = Cam[i]<n->lo[i] ? n->lo[i] : Cam[i]>n->hi[i] ? n->hi[i] : Cam[i];
+   for (i=0;i<3;i++)
+      e[i] = M[i]*q[0] + M[4+i]*q[1] + M[8+i]*q[2] + M[12+i];
+   d = sqrt(e[0]*e[0]+e[1]*e[1]+e[2]*e[2]);
+   sse = ortho ? n->error*Zscale*Kpix : (d>0) ? n->error*Zscale*Kpix/d : 1e30;
+   //  Finer chunks
+   if (sse>maxError && n->child[0]+n->child[1]+n->child[2]+n->child[3]>-4)
+   {
+      for (i=0;i<4;i++)
+         if (n->child[i]>=0) tri += DrawNode(t,n->child[i]);
+      return tri;
+   }
+   //  This chunk
+   glVertexPointer(3,GL_FLOAT,sizeof(vertex_t),(void*)(n->first*sizeof(vertex_t)));
+   glNormalPointer(GL_BYTE,sizeof(vertex_t),(void*)(n->first*sizeof(vertex_t)+3*sizeof(float)));
+   glDrawElements(GL_TRIANGLE_STRIP,Nindex,GL_UNSIGNED_SHORT,(void*)0);
+   return 2*CHUNK*CHUNK + 8*CHUNK;
+}
+
+/*
+ *  Draw terrain with the current transform, color and texture
+ *    Returns the number of triangles drawn
+ */
+int DrawTerrain(int ter)
+{
+   int i,j,tri;
+   int    vp[4];
+   double P[16],C[16],det;
+   float  S[4],T[4];
+   terrain_t* t;
+   if (ter<1 || ter>Nterrain || !terrain[ter-1].vbo) return 0;
+   t = terrain+ter-1;
+
+   //  View from the current matrices
+   glGetDoublev(GL_MODELVIEW_MATRIX,M);
+   glGetDoublev(GL_PROJECTION_MATRIX,P);
+   glGetIntegerv(GL_VIEWPORT,vp);
+   ortho = P[15]!=0;
+   Kpix = P[5]*vp[3]/2;
+   Zscale = sqrt(M[8]*M[8]+M[9]*M[9]+M[10]*M[10]);
+   //  Eye is where the modelview takes the origin, found by inverting its rotation and scale
+   det = M[0]*(M[5]*M[10]-M[9]*M[6]) - M[4]*(M[1]*M[10]-M[9]*M[2]) + M[8]*(M[1]*M[6]-M[5]*M[2]);
+   for (i=0;i<3;i++)
+   {
+      //  Row i of the inverse is the cross product of columns i+1 and i+2
+      const double* a = M+4*((i+1)%3);
+      const double* b = M+4*((i+2)%3);
+      double r[3] = {a[1]*b[2]-a[2]*b[1],a[2]*b[0]-a[0]*b[2],a[0]*b[1]-a[1]*b[0]};
+      Cam[i] = -(r[0]*M[12]+r[1]*M[13]+r[2]*M[14])/det;
+   }
+   //  Clip planes are the sums and differences of rows of projection x modelview
+   for (i=0;i<4;i++)
+      for (j=0;j<4;j++)
+         C[4*i+j] = P[j]*M[4*i] + P[4+j]*M[4*i+1] + P[8+j]*M[4*i+2] + P[12+j]*M[4*i+3];
+   for (i=0;i<3;i++)
+      for (j=0;j<4;j++)
+      {
+         F[2*i][j]   = C[4*j+3] + C[4*j+i];
+         F[2*i+1][j] = C[4*j+3] - C[4*j+i];
+      }
+
+   //  Texture spread once over the terrain
+   S[0] = 1/t->w; S[1] = 0; S[2] = 0; S[3] = 0.5;
+   T[0] = 0; T[1] = 1/t->h; T[2] = 0; T[3] = 0.5;
+   glPushAttrib(GL_TEXTURE_BIT);
+   glTexGeni(GL_S,GL_TEXTURE_GEN_MODE,GL_OBJECT_LINEAR);
+   glTexGeni(GL_T,GL_TEXTURE_GEN_MODE,GL_OBJECT_LINEAR);
+   glTexGenfv(GL_S,GL_OBJECT_PLANE,S);
+   glTexGenfv(GL_T,GL_OBJECT_PLANE,T);
+   glEnable(GL_TEXTURE_GEN_S);
+   glEnable(GL_TEXTURE_GEN_T);
+   //  Chunks share the index buffer and start at different vertexes
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glBindBuffer(GL_ARRAY_BUFFER,t->vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   tri = DrawNode(t,0);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+   glPopAttrib();
+   return tri;
+}
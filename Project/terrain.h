@@ -0,0 +1,24 @@
+#ifndef TERRAIN
+#define TERRAIN
+
+#include "heightfield.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct TerrainMesh TerrainMesh;
+TerrainMesh* BuildTerrain(const HeightField* hf);
+void FreeTerrainMesh(TerrainMesh* mesh);
+int  UploadTerrain(TerrainMesh* mesh);
+int  LoadTerrain(const HeightField* hf);
+long long TerrainBytes(int ter);
+void FreeTerrain(int ter);
+int  DrawTerrain(int ter);
+void TerrainError(double pixels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,549 @@
+/*
+ *  Terrain streamed from a tiled store
+ *
+ *  A tile store cuts a heightfield and the image draped over it into square
+ *  tiles, each holding its own heights, normals and texture at a fixed place
+ *  in the file.  OpenTerrainTiles reads only the header.  UpdateTerrainTiles asks
+ *  for the tiles within a radius of the eye, nearest first, and a loader
+ *  thread reads them and builds their meshes while the game runs.  Finished
+ *  tiles are uploaded a few per frame and stay resident until the memory
+ *  they hold passes the budget, when the tiles used least recently are
+ *  dropped.  Only the neighbourhood of the eye is ever in memory however
+ *  large the region is.  Resident tiles keep their heights and normals so
+ *  TerrainTilesHeight can find the ground under a point.
+ *
+ *  Tiles share the height range of the whole region so their edges meet,
+ *  and the skirts of their chunks hide the cracks where neighbours are
+ *  drawn at different detail.  The region is centered on the origin in x
+ *  and y with heights measured up from its lowest point.
+ */
+#include "CSCIx229.h"
+#include "heightfield.h"
+#include "terrain.h"
+#include "tiles.h"
+#include <pthread.h>
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#endif
+
+//  Tiles loaded and waiting for upload
+//  The loader blocks when this many are queued which bounds the memory used
+#define MAX_READY 4
+//  Tiles uploaded per frame
+#define MAX_UPLOAD 2
+
+//  Tile store header
+#define TILES_VERSION 2
+typedef struct
+{
+   char  magic[4];   //  Always TILE
+   int   version;    //  TILES_VERSION
+   int   tile;       //  Cells along the side of a tile
+   int   tex;        //  Texture pixels along the side of a tile
+   int   nx,ny;      //  Tiles in x and y
+   float dx,dy;      //  Spacing of samples
+   float zmin,zmax;  //  Height range of the region
+} tiles_t;
+
+//  Tile states (only changed by the OpenGL thread)
+enum {TILE_EMPTY,TILE_QUEUED,TILE_RESIDENT};
+
+//  Tile
+typedef struct tile_s
+{
+   struct tile_s* next;     // Next in queue
+   int            state;    // TILE_EMPTY etc.
+   int            used;     // Last update that wanted the tile
+   int            ter;      // Terrain when resident
+   unsigned int   tex;      // Texture when resident
+   long long      bytes;    // Memory held when resident
+   TerrainMesh*   mesh;     // Mesh when loaded
+   unsigned char* image;    // Texture image when loaded
+   float*         z;        // Heights then normals when loaded or resident
+} tile_t;
+
+//  Tile near the eye
+typedef struct
+{
+   double d;  // Distance from the eye
+   int    k;  // Tile
+} want_t;
+
+//  Open store
+static tiles_t   H;            //  Header
+static FILE*     store=NULL;   //  File read by the loader
+static tile_t*   tile=NULL;    //  Tiles in rows of x
+static want_t*   want=NULL;    //  Tiles near the eye
+static long long budget=0;     //  Memory allowed for resident tiles
+static long long bytes=0;      //  Memory held by resident tiles
+static int       Nresident=0;  //  Resident tiles
+static int       Npending=0;   //  Tiles requested and not yet uploaded
+static int       frame=0;      //  Update count
+static pthread_t loader;       //  Loader thread
+
+//  Queues are guarded by one mutex
+static pthread_mutex_t lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work  = PTHREAD_COND_INITIALIZER;  // Tile queued
+static pthread_cond_t  room  = PTHREAD_COND_INITIALIZER;  // Tile uploaded
+static tile_t* todo=NULL;      //  Tiles waiting for the loader
+static tile_t* todoEnd=NULL;
+static tile_t* done=NULL;      //  Tiles waiting for upload
+static tile_t* doneEnd=NULL;
+static int Nready=0;           //  Tiles in done
+static int quit=0;             //  Loader should stop
+
+/*
+ *  Bytes of a tile in the store
+ */
+static size_t TileBytes(const tiles_t* h)
+{
+   return (sizeof(float)+4)*(h->tile+1)*(h->tile+1) + 3*(size_t)h->tex*h->tex;
+}
+
+/*
+ *  Color of an image at s,t (0 to 1) interpolated between pixel centers
+ */
+static void Sample(const unsigned char* image,int dx,int dy,double s,double t,unsigned char* rgb)
+{
+   int    c;
+   double x = s*dx-0.5, y = t*dy-0.5;
+   int    i0,j0,i1,j1;
+   x = x<0 ? 0 : x>dx-1 ? dx-1 : x;
+   y = y<0 ? 0 : y>dy-1 ? dy-1 : y;
+   i0 = (int)x; i1 = i0<dx-1 ? i0+1 : i0;
+   j0 = (int)y; j1 = j0<dy-1 ? j0+1 : j0;
+   x -= i0;
+   y -= j0;
+   for (c=0;c<3;c++)
+   {
+      double a = (1-x)*image[3*(j0*dx+i0)+c] + x*image[3*(j0*dx+i1)+c];
+      double b = (1-x)*image[3*(j1*dx+i0)+c] + x*image[3*(j1*dx+i1)+c];
+      rgb[c] = (unsigned char)floor((1-y)*a+y*b+0.5);
+   }
+}
+
+/*
+ *  Cut a heightfield and a BMP draped over it into a tile store
+ *    Tiles are tile cells across with a tex x tex texture
+ */
+void SaveTerrainTiles(const char* file,const char* hfFile,const char* bmp,int size,int tex)
+{
+   int    i,j,tx,ty,n;
+   unsigned int   bx,by;
+   unsigned char* image;
+   unsigned char* rgb;
+   float*         z;
+   signed char*   nrm;
+   char           tmp[strlen(file)+5];
+   HeightField    hf;
+   tiles_t        h;
+   FILE*          f;
+
+   //  Sources
+   if (MapHeightField(hfFile,&hf)) Fatal("Cannot read heightfield %s\n",hfFile);
+   image = ReadBMP(bmp,&bx,&by);
+
+   //  Header
+   memset(&h,0,sizeof(h));
+   memcpy(h.magic,"TILE",4);
+   h.version = TILES_VERSION;
+   h.tile = size;
+   h.tex = tex;
+   h.nx = (hf.nx-2)/size+1;
+   h.ny = (hf.ny-2)/size+1;
+   h.dx = hf.dx;
+   h.dy = hf.dy;
+   h.zmin = hf.zmin;
+   h.zmax = hf.zmax;
+
+   //  One tile at a time
+   n = (size+1)*(size+1);
+   z = (float*)malloc(n*sizeof(float));
+   nrm = (signed char*)malloc(4*n);
+   rgb = (unsigned char*)malloc(3*tex*tex);
+   if (!z || !nrm || !rgb) Fatal("Cannot allocate memory for tiles %s\n",file);
+
+   //  Write to a temporary file and rename so a partial store is never seen
+   sprintf(tmp,"%s.tmp",file);
+   f = fopen(tmp,"wb");
+   if (!f) Fatal("Cannot open file %s\n",tmp);
+   if (fwrite(&h,sizeof(h),1,f)!=1) Fatal("Cannot write tiles %s\n",tmp);
+   for (ty=0;ty<h.ny;ty++)
+      for (tx=0;tx<h.nx;tx++)
+      {
+         //  Heights and normals with the edge of the heightfield repeated beyond it
+         for (j=0;j<=size;j++)
+            for (i=0;i<=size;i++)
+            {
+               int x = tx*size+i < hf.nx ? tx*size+i : hf.nx-1;
+               int y = ty*size+j < hf.ny ? ty*size+j : hf.ny-1;
+               z[j*(size+1)+i] = hf.z[(size_t)y*hf.nx+x];
+               memcpy(nrm+4*(j*(size+1)+i),hf.n+4*((size_t)y*hf.nx+x),4);
+            }
+         //  The image covers the heightfield once
+         for (j=0;j<tex;j++)
+            for (i=0;i<tex;i++)
+               Sample(image,bx,by,(tx+(i+0.5)/tex)*size/(hf.nx-1),(ty+(j+0.5)/tex)*size/(hf.ny-1),rgb+3*(j*tex+i));
+         if (fwrite(z,sizeof(float),n,f)!=n || fwrite(nrm,4,n,f)!=n || fwrite(rgb,3,tex*tex,f)!=tex*tex) Fatal("Cannot write tiles %s\n",tmp);
+      }
+   if (fclose(f) || rename(tmp,file))
+   {
+      remove(tmp);
+      Fatal("Cannot write tiles %s\n",file);
+   }
+   free(z);
+   free(nrm);
+   free(rgb);
+   free(image);
+   UnmapHeightField(&hf);
+}
+
+/*
+ *  Append tile to queue
+ */
+static void Push(tile_t** head,tile_t** tail,tile_t* t)
+{
+   t->next = NULL;
+   if (*tail)
+      (*tail)->next = t;
+   else
+      *head = t;
+   *tail = t;
+}
+
+/*
+ *  Remove tile from front of queue
+ */
+static tile_t* Pop(tile_t** head,tile_t** tail)
+{
+   tile_t* t = *head;
+   *head = t->next;
+   if (!*head) *tail = NULL;
+   return t;
+}
+
+/*
+ *  Loader thread reads tiles and builds their meshes
+ */
+static void* Loader(void* arg)
+{
+   int   n = (H.tile+1)*(H.tile+1);
+   int   m = H.tex*H.tex;
+   HeightField hf;
+   //  Every tile is a heightfield with the height range of the region
+   memset(&hf,0,sizeof(hf));
+   hf.nx = hf.ny = H.tile+1;
+   hf.dx = H.dx;
+   hf.dy = H.dy;
+   hf.zmin = H.zmin;
+   hf.zmax = H.zmax;
+   while (1)
+   {
+      tile_t*   t;
+      long long k;
+      //  Wait for a tile
+      pthread_mutex_lock(&lock);
+      while (!todo && !quit)
+         pthread_cond_wait(&work,&lock);
+      if (quit)
+      {
+         pthread_mutex_unlock(&lock);
+         break;
+      }
+      t = Pop(&todo,&todoEnd);
+      pthread_mutex_unlock(&lock);
+      //  Read and build without holding the lock
+      k = t-tile;
+      t->image = (unsigned char*)malloc(3*m);
+      t->z = (float*)malloc(n*(sizeof(float)+4));
+      if (!t->image || !t->z) Fatal("Cannot allocate memory for terrain tiles\n");
+      hf.z = t->z;
+      hf.n = (signed char*)(t->z+n);
+      if (fseeko(store,sizeof(tiles_t)+k*TileBytes(&H),SEEK_SET) ||
+          fread(t->z,sizeof(float),n,store)!=n || fread(t->z+n,4,n,store)!=n || fread(t->image,3,m,store)!=m)
+         Fatal("Cannot read terrain tile %d\n",(int)k);
+      t->mesh = BuildTerrain(&hf);
+      //  Queue for upload when there is room
+      pthread_mutex_lock(&lock);
+      while (Nready>=MAX_READY && !quit)
+         pthread_cond_wait(&room,&lock);
+      Push(&done,&doneEnd,t);
+      Nready++;
+      pthread_mutex_unlock(&lock);
+   }
+   return NULL;
+}
+
+/*
+ *  Open a tile store
+ *    Resident tiles are kept within budget bytes
+ *    Returns 0 on success
+ */
+int OpenTerrainTiles(const char* file,long long limit)
+{
+   long long size,mtime;
+   CloseTerrainTiles();
+   store = fopen(file,"rb");
+   if (!store) return -1;
+   //  Check header and size
+   if (fread(&H,sizeof(H),1,store)!=1 || memcmp(H.magic,"TILE",4) || H.version!=TILES_VERSION ||
+       H.tile<1 || H.tex<1 || H.nx<1 || H.ny<1 || FileStamp(file,&size,&mtime) ||
+       size!=sizeof(tiles_t)+(long long)H.nx*H.ny*TileBytes(&H))
+   {
+      fprintf(stderr,"Ignoring corrupt terrain tiles %s\n",file);
+      fclose(store);
+      store = NULL;
+      return -1;
+   }
+   tile = (tile_t*)calloc((size_t)H.nx*H.ny,sizeof(tile_t));
+   want = (want_t*)malloc((size_t)H.nx*H.ny*sizeof(want_t));
+   if (!tile || !want) Fatal("Cannot allocate memory for terrain tiles %s\n",file);
+   budget = limit;
+   bytes = 0;
+   Nresident = Npending = frame = 0;
+   quit = 0;
+   if (pthread_create(&loader,NULL,Loader,NULL)) Fatal("Cannot start terrain tile loader thread\n");
+   return 0;
+}
+
+/*
+ *  Sort tiles nearest first
+ */
+static int CompareWant(const void* a,const void* b)
+{
+   double x = ((const want_t*)a)->d;
+   double y = ((const want_t*)b)->d;
+   return (x>y) - (x<y);
+}
+
+/*
+ *  Drop a resident tile
+ */
+static void Evict(tile_t* t)
+{
+   FreeTerrain(t->ter);
+   glDeleteTextures(1,&t->tex);
+   free(t->z);
+   t->z = NULL;
+   bytes -= t->bytes;
+   Nresident--;
+   t->state = TILE_EMPTY;
+}
+
+/*
+ *  Stream tiles around the eye at x,y in region coordinates
+ *    Call once per frame from the OpenGL thread
+ *    Tiles within radius are loaded nearest first, as many as fit the budget
+ */
+void UpdateTerrainTiles(double x,double y,double radius)
+{
+   int    i,j,k,n=0,max;
+   int    i0,i1,j0,j1;
+   double w,h;
+   if (!tile) return;
+   frame++;
+   w = H.tile*H.dx;
+   h = H.tile*H.dy;
+
+   //  Tiles touching the square around the circle
+   i0 = (int)floor((x-radius)/w+H.nx/2.0);
+   i1 = (int)floor((x+radius)/w+H.nx/2.0);
+   j0 = (int)floor((y-radius)/h+H.ny/2.0);
+   j1 = (int)floor((y+radius)/h+H.ny/2.0);
+   if (i0<0) i0 = 0;
+   if (j0<0) j0 = 0;
+   if (i1>H.nx-1) i1 = H.nx-1;
+   if (j1>H.ny-1) j1 = H.ny-1;
+   //  Distance to the nearest point of each
+   for (j=j0;j<=j1;j++)
+      for (i=i0;i<=i1;i++)
+      {
+         double x0 = i*w-H.nx*w/2, y0 = j*h-H.ny*h/2;
+         double px = x<x0 ? x0 : x>x0+w ? x0+w : x;
+         double py = y<y0 ? y0 : y>y0+h ? y0+h : y;
+         double d = sqrt((px-x)*(px-x)+(py-y)*(py-y));
+         if (d>radius) continue;
+         want[n].d = d;
+         want[n].k = j*H.nx+i;
+         n++;
+      }
+   qsort(want,n,sizeof(want_t),CompareWant);
+   //  As many as fit the budget at the size of the tiles already resident
+   max = Nresident ? budget/(bytes/Nresident) : n;
+   if (max<1) max = 1;
+   if (n>max) n = max;
+
+   //  Replace the requests nobody has started on with the tiles wanted now
+   pthread_mutex_lock(&lock);
+   while (todo)
+   {
+      Pop(&todo,&todoEnd)->state = TILE_EMPTY;
+      Npending--;
+   }
+   for (k=0;k<n;k++)
+   {
+      tile_t* t = tile+want[k].k;
+      t->used = frame;
+      if (t->state==TILE_EMPTY)
+      {
+         t->state = TILE_QUEUED;
+         Push(&todo,&todoEnd,t);
+         Npending++;
+      }
+   }
+   if (todo) pthread_cond_signal(&work);
+   pthread_mutex_unlock(&lock);
+
+   //  Upload a few loaded tiles (texture bindings are restored afterwards)
+   glPushAttrib(GL_TEXTURE_BIT);
+   for (k=0;k<MAX_UPLOAD;k++)
+   {
+      tile_t* t;
+      pthread_mutex_lock(&lock);
+      if (!done)
+      {
+         pthread_mutex_unlock(&lock);
+         break;
+      }
+      t = Pop(&done,&doneEnd);
+      Nready--;
+      pthread_cond_signal(&room);
+      pthread_mutex_unlock(&lock);
+      //  Mesh and texture with mipmaps built as it is copied
+      t->ter = UploadTerrain(t->mesh);
+      t->mesh = NULL;
+      glGenTextures(1,&t->tex);
+      glBindTexture(GL_TEXTURE_2D,t->tex);
+      glTexParameteri(GL_TEXTURE_2D,GL_GENERATE_MIPMAP,GL_TRUE);
+      TexImageBMP("terrain tile",H.tex,H.tex,1,t->image);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+      free(t->image);
+      t->image = NULL;
+      //  The mip chain adds a third to the texture
+      t->bytes = TerrainBytes(t->ter) + 4*(long long)H.tex*H.tex + (sizeof(float)+4)*(long long)(H.tile+1)*(H.tile+1);
+      t->state = TILE_RESIDENT;
+      bytes += t->bytes;
+      Nresident++;
+      Npending--;
+   }
+   glPopAttrib();
+
+   //  Drop the tiles used least recently until the budget is met
+   while (bytes>budget)
+   {
+      tile_t* lru = NULL;
+      for (k=0;k<H.nx*H.ny;k++)
+         if (tile[k].state==TILE_RESIDENT && tile[k].used<frame && (!lru || tile[k].used<lru->used))
+            lru = tile+k;
+      //  Everything resident is wanted
+      if (!lru) break;
+      Evict(lru);
+   }
+   ErrCheck("UpdateTerrainTiles");
+}
+
+/*
+ *  Draw the resident tiles with the current transform and color
+ *    Returns the number of triangles drawn
+ */
+int DrawTerrainTiles(void)
+{
+   int    i,j,tri=0;
+   double w,h;
+   if (!tile) return 0;
+   w = H.tile*H.dx;
+   h = H.tile*H.dy;
+   glPushAttrib(GL_TEXTURE_BIT);
+   for (j=0;j<H.ny;j++)
+      for (i=0;i<H.nx;i++)
+      {
+         tile_t* t = tile+j*H.nx+i;
+         if (t->state!=TILE_RESIDENT) continue;
+         //  Tile in its place with the lowest point of the region at zero
+         glPushMatrix();
+         glTranslated((i+0.5)*w-H.nx*w/2,(j+0.5)*h-H.ny*h/2,(H.zmax-H.zmin)/2);
+         glBindTexture(GL_TEXTURE_2D,t->tex);
+         tri += DrawTerrain(t->ter);
+         glPopMatrix();
+      }
+   glPopAttrib();
+   return tri;
+}
+
+/*
+ *  Height of the ground at x,y in region coordinates and its unit normal in n
+ *    Heights are measured up from the lowest point of the region as drawn
+ *    Returns 0 if a resident tile is there
+ */
+int TerrainTilesHeight(double x,double y,double* z,double n[3])
+{
+   int    i,j;
+   double w,h;
+   tile_t* t;
+   HeightField hf;
+   if (!tile) return -1;
+   w = H.tile*H.dx;
+   h = H.tile*H.dy;
+   i = (int)floor(x/w+H.nx/2.0);
+   j = (int)floor(y/h+H.ny/2.0);
+   if (i<0 || i>=H.nx || j<0 || j>=H.ny) return -1;
+   t = tile+j*H.nx+i;
+   if (t->state!=TILE_RESIDENT) return -1;
+   //  Tile as a heightfield measured from its first sample
+   memset(&hf,0,sizeof(hf));
+   hf.nx = hf.ny = H.tile+1;
+   hf.dx = H.dx;
+   hf.dy = H.dy;
+   hf.z = t->z;
+   hf.n = (const signed char*)(t->z+hf.nx*hf.ny);
+   x -= i*w-H.nx*w/2;
+   y -= j*h-H.ny*h/2;
+   *z = HeightFieldHeight(&hf,x,y) - H.zmin;
+   if (n) HeightFieldNormal(&hf,x,y,n);
+   return 0;
+}
+
+/*
+ *  Number of resident and loading tiles and the memory held
+ */
+void TerrainTilesInfo(int* resident,int* loading,long long* held)
+{
+   *resident = Nresident;
+   *loading = Npending;
+   *held = bytes;
+}
+
+/*
+ *  Stop streaming and release every tile
+ */
+void CloseTerrainTiles(void)
+{
+   int k;
+   if (!tile) return;
+   //  Stop the loader
+   pthread_mutex_lock(&lock);
+   quit = 1;
+   pthread_cond_broadcast(&work);
+   pthread_cond_broadcast(&room);
+   pthread_mutex_unlock(&lock);
+   pthread_join(loader,NULL);
+   //  Release tiles in every state
+   for (k=0;k<H.nx*H.ny;k++)
+   {
+      if (tile[k].state==TILE_RESIDENT) Evict(tile+k);
+      if (tile[k].mesh) FreeTerrainMesh(tile[k].mesh);
+      free(tile[k].image);
+      free(tile[k].z);
+   }
+   todo = todoEnd = done = doneEnd = NULL;
+   Nready = Npending = 0;
+   free(tile);
+   free(want);
+   fclose(store);
+   tile = NULL;
+   want = NULL;
+   store = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef TILES
+#define TILES
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void SaveTerrainTiles(const char* file,const char* hf,const char* bmp,int tile,int tex);
+int  OpenTerrainTiles(const char* file,long long budget);
+void UpdateTerrainTiles(double x,double y,double radius);
+int  DrawTerrainTiles(void);
+int  TerrainTilesHeight(double x,double y,double* z,double n[3]);
+void TerrainTilesInfo(int* resident,int* loading,long long* bytes);
+void CloseTerrainTiles(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,587 @@
+/*
+ *  Packed video clips streamed into one texture
+ *
+ *  A clip is a single file holding a header, a frame index and the frames.
+ *  Each frame is stored raw, run length encoded, or as the run length
+ *  encoded XOR with the previous frame, whichever is smallest, with a key
+ *  frame that does not depend on earlier frames every KEYINT frames.
+ *  SaveClip packs a numbered BMP sequence (see mkclip.c).
+ *
+ *  OpenVideo maps a clip and a decoder thread decodes frames in a loop into a
+ *  small ring, only decoding delta frames forward from the nearest key frame
+ *  when it has to skip.  UpdateVideo works out which frame is due from a
+ *  media clock running at the source frame rate, drops frames that are late
+ *  or repeats the current one if the decoder is behind, and only touches the
+ *  texture when the frame changes.  A new frame is copied into a pixel buffer
+ *  object and from there into the video texture, alternating between two
+ *  pixel buffers so a buffer the GPU may still be reading from is never
+ *  overwritten.  Replays call SyncVideo so the frame shown depends only on
+ *  the clock and not on how far the decoder has got.  The ring's frames are
+ *  allocated when the video is opened and reused, so memory use is RING
+ *  frames no matter how long the clip is and playing allocates nothing.
+ *  CloseVideo stops the decoder and releases the video.
+ *
+ *  Frames are numbered from the start of playback without wrapping so the
+ *  clock and the decoder agree on order across loops of the clip.
+ */
+#include "CSCIx229.h"
+#include <pthread.h>
+
+//  Clip header
+#define CLIP_VERSION 1
+typedef struct
+{
+   char  magic[4];           // "CLIP"
+   int   version;            // CLIP_VERSION
+   unsigned int dx,dy;       // Frame size
+   unsigned int count;       // Number of frames
+   float fps;                // Source frame rate
+   int   keyint;             // Key frame interval
+   int   pad;
+} clip_t;
+
+//  Frame index entry
+#define FRAME_RAW   0        // RGB pixels
+#define FRAME_RLE   1        // Run length encoded pixels
+#define FRAME_DELTA 2        // Run length encoded XOR with the previous frame
+typedef struct
+{
+   long long    offset;      // Offset of frame in file
+   unsigned int size;        // Bytes in file
+   int          codec;       // FRAME_RAW, FRAME_RLE or FRAME_DELTA
+} frame_t;
+
+//  Key frame interval written by SaveClip
+#define KEYINT 30
+
+/*
+ *  Run length encode n bytes
+ *    A control byte c<128 is followed by c+1 literal bytes,
+ *    otherwise the next byte repeats c-125 times (3-130)
+ *    Returns the encoded size which is at most n+n/128+1
+ */
+static unsigned int EncodeRLE(const unsigned char* src,unsigned int n,unsigned char* dst)
+{
+   unsigned int i=0,k=0;
+   int lit=-1;   // Control byte of the literal run in progress
+   while (i<n)
+   {
+      //  Length of run at i
+      unsigned int r=1;
+      while (i+r<n && r<130 && src[i+r]==src[i])
+         r++;
+      //  Repeated byte
+      if (r>=3)
+      {
+         dst[k++] = r+125;
+         dst[k++] = src[i];
+         i += r;
+         lit = -1;
+      }
+      //  Literal byte
+      else
+      {
+         if (lit<0 || dst[lit]==127)
+         {
+            lit = k;
+            dst[k++] = 0;
+         }
+         else
+            dst[lit]++;
+         dst[k++] = src[i++];
+      }
+   }
+   return k;
+}
+
+/*
+ *  Decode run length encoded bytes into n bytes
+ *    XOR with the output if delta is set
+ *    Returns 0 if the data does not decode to exactly n bytes
+ */
+static int DecodeRLE(const unsigned char* src,unsigned int len,unsigned char* dst,unsigned int n,int delta)
+{
+   const unsigned char* e = src+len;
+   unsigned int k=0;
+   while (src<e)
+   {
+      unsigned int c = *src++;
+      if (c<128)
+      {
+         //  Literal bytes
+         c++;
+         if (src+c>e || k+c>n) return 0;
+         if (delta)
+            while (c--) dst[k++] ^= *src++;
+         else
+         {
+            memcpy(dst+k,src,c);
+            k += c;
+            src += c;
+         }
+      }
+      else
+      {
+         //  Repeated byte
+         unsigned char b;
+         c -= 125;
+         if (src>=e || k+c>n) return 0;
+         b = *src++;
+         if (delta)
+         {
+            if (b) while (c--) dst[k++] ^= b;
+            else k += c;
+         }
+         else
+         {
+            memset(dst+k,b,c);
+            k += c;
+         }
+      }
+   }
+   return k==n;
+}
+
+/*
+ *  Pack a numbered BMP sequence path-1.bmp .. path-count.bmp into a clip
+ */
+void SaveClip(const char* file,const char* path,unsigned int count,double fps)
+{
+   unsigned int   k,n=0;
+   unsigned int   dx=0,dy=0;
+   unsigned char* prev=NULL;  // Previous frame
+   unsigned char* work=NULL;  // Delta of frame
+   unsigned char* rle=NULL;   // Encoded frame
+   unsigned char* best=NULL;  // Encoded delta
+   long long      offset;
+   clip_t         h;
+   frame_t*       index;
+   char  tmp[strlen(file)+5];
+   char  bmp[strlen(path)+16];
+   FILE* f;
+   int   err;
+
+   if (count<1) Fatal("No frames for clip %s\n",file);
+   index = (frame_t*)calloc(count,sizeof(frame_t));
+   if (!index) Fatal("Cannot allocate memory for clip %s\n",file);
+
+   //  Write to a temporary file and rename so a partial clip is never seen
+   sprintf(tmp,"%s.tmp",file);
+   f = fopen(tmp,"wb");
+   if (!f) Fatal("Cannot open file %s\n",tmp);
+   //  Header and index are written again once the frames are known
+   memset(&h,0,sizeof(h));
+   fwrite(&h,sizeof(h),1,f);
+   fwrite(index,sizeof(frame_t),count,f);
+   offset = sizeof(h) + count*(long long)sizeof(frame_t);
+
+   //  Encode frames
+   for (k=0;k<count;k++)
+   {
+      unsigned int   size;
+      unsigned int   fx,fy,i;
+      unsigned char* image;
+      const unsigned char* data;
+      sprintf(bmp,"%s-%u.bmp",path,k+1);
+      image = ReadBMP(bmp,&fx,&fy);
+      //  Size is set by the first frame
+      if (k==0)
+      {
+         dx = fx;
+         dy = fy;
+         n = 3*dx*dy;
+         work = (unsigned char*)malloc(n);
+         rle  = (unsigned char*)malloc(n+n/128+1);
+         best = (unsigned char*)malloc(n+n/128+1);
+         if (!work || !rle || !best) Fatal("Cannot allocate memory for clip %s\n",file);
+      }
+      else if (fx!=dx || fy!=dy)
+         Fatal("%s is %dx%d but the clip is %dx%d\n",bmp,fx,fy,dx,dy);
+      //  Raw
+      index[k].codec = FRAME_RAW;
+      data = image;
+      size = n;
+      //  Run length encoded
+      i = EncodeRLE(image,n,rle);
+      if (i<size)
+      {
+         index[k].codec = FRAME_RLE;
+         data = rle;
+         size = i;
+      }
+      //  Delta from the previous frame except on key frames
+      if (k%KEYINT)
+      {
+         for (i=0;i<n;i++)
+            work[i] = image[i]^prev[i];
+         i = EncodeRLE(work,n,best);
+         if (i<size)
+         {
+            index[k].codec = FRAME_DELTA;
+            data = best;
+            size = i;
+         }
+      }
+      fwrite(data,size,1,f);
+      index[k].offset = offset;
+      index[k].size = size;
+      offset += size;
+      free(prev);
+      prev = image;
+   }
+
+   //  Header and index
+   memcpy(h.magic,"CLIP",4);
+   h.version = CLIP_VERSION;
+   h.dx = dx;
+   h.dy = dy;
+   h.count = count;
+   h.fps = fps;
+   h.keyint = KEYINT;
+   if (fseek(f,0,SEEK_SET)==0)
+   {
+      fwrite(&h,sizeof(h),1,f);
+      fwrite(index,sizeof(frame_t),count,f);
+   }
+   err = ferror(f);
+   if (fclose(f) || err || rename(tmp,file))
+   {
+      remove(tmp);
+      Fatal("Cannot write clip %s\n",file);
+   }
+   free(prev);
+   free(work);
+   free(rle);
+   free(best);
+   free(index);
+}
+
+//  Decoded frames buffered ahead of display
+#define RING 4
+
+//  Decoded frame
+typedef struct
+{
+   unsigned char* image;     // RGB pixels (allocated once with the video)
+   long long      seq;       // Frame number since playback started
+} slot_t;
+
+//  Video stream
+typedef struct
+{
+   char*          file;      // Clip file
+   unsigned char* map;       // Mapped clip
+   size_t         len;       // Length of mapping
+   clip_t*        h;         // Header
+   frame_t*       index;     // Frame index
+   unsigned char* ref;       // Last frame decoded (decoder thread only)
+   int            have;      // Frame in ref (-1 for none)
+   unsigned int   count;     // Number of frames
+   double         fps;       // Source frame rate
+   double         t0;        // Clock time of frame 0 (<0 until started)
+   unsigned int   tex;       // Video texture
+   unsigned int   pbo[2];    // Pixel buffers
+   int            ping;      // Pixel buffer to write next
+   unsigned int   dx,dy;     // Frame size (0 until the first upload)
+   long long      seq;       // Frame in the texture (-1 for none)
+   pthread_t      thread;    // Decoder
+   //  Ring of decoded frames guarded by lock
+   //    The decoder fills the slot after the last and UpdateVideo empties the first,
+   //    so each can use its slot without holding the lock
+   pthread_mutex_t lock;
+   pthread_cond_t  full;     // Slot freed
+   pthread_cond_t  ready;    // Slot filled
+   slot_t          ring[RING];
+   int             head,n;   // Oldest slot and slots in use
+   long long       want;     // Frame due on the clock, earlier frames are skipped
+   int             stop;     // Decoder should finish
+} video_t;
+
+//  Video streams
+static int Nvideo=0;
+static video_t** video=NULL;
+//  Wait for each frame rather than repeat one
+static int lockstep=0;
+
+/*
+ *  Decode frame k of a clip into ref
+ *    Delta frames need frame k-1 in ref
+ */
+static void DecodeFrame(video_t* v,int k)
+{
+   unsigned int   n = 3*v->h->dx*v->h->dy;
+   frame_t*       f = v->index+k;
+   unsigned char* data = v->map+f->offset;
+   int ok;
+   if (f->codec==FRAME_RAW)
+   {
+      ok = f->size==n;
+      if (ok) memcpy(v->ref,data,n);
+   }
+   else
+      ok = DecodeRLE(data,f->size,v->ref,n,f->codec==FRAME_DELTA);
+   if (!ok) Fatal("Corrupt frame %d in %s\n",k,v->file);
+   v->have = k;
+}
+
+/*
+ *  Decoder thread keeps the ring full until CloseVideo
+ */
+static void* Decoder(void* arg)
+{
+   video_t* v = (video_t*)arg;
+   size_t n = 3*(size_t)v->h->dx*v->h->dy;
+   long long seq = 0;
+   while (1)
+   {
+      slot_t* s;
+      int k,key;
+      //  Skip frames the clock has already passed
+      pthread_mutex_lock(&v->lock);
+      if (seq<v->want) seq = v->want;
+      pthread_mutex_unlock(&v->lock);
+      //  Decode forward from the key frame unless the frames before are already decoded
+      k = seq%v->count;
+      for (key=k;v->index[key].codec==FRAME_DELTA;key--);
+      if (v->have<key || v->have>k) DecodeFrame(v,key);
+      while (v->have<k)
+         DecodeFrame(v,v->have+1);
+      //  Wait for a free slot
+      pthread_mutex_lock(&v->lock);
+      while (v->n==RING && !v->stop)
+         pthread_cond_wait(&v->full,&v->lock);
+      if (v->stop) break;
+      s = v->ring+(v->head+v->n)%RING;
+      pthread_mutex_unlock(&v->lock);
+      //  Copy frame to the slot
+      memcpy(s->image,v->ref,n);
+      s->seq = seq++;
+      pthread_mutex_lock(&v->lock);
+      v->n++;
+      pthread_cond_signal(&v->ready);
+      pthread_mutex_unlock(&v->lock);
+   }
+   pthread_mutex_unlock(&v->lock);
+   return NULL;
+}
+
+/*
+ *  Open a clip packed by SaveClip
+ *    Plays at fps frames per second of the clock passed to UpdateVideo (0 for the clip's rate)
+ *    Returns video number for UpdateVideo and VideoTexture
+ */
+int OpenVideo(const char* file,double fps)
+{
+   unsigned int k;
+   size_t n;
+   const unsigned char grey[3] = {128,128,128};
+   video_t* v = (video_t*)calloc(1,sizeof(video_t));
+   if (!v) Fatal("Cannot allocate memory for video %s\n",file);
+   v->file = strdup(file);
+   if (!v->file) Fatal("Cannot allocate memory for video %s\n",file);
+
+   //  Map clip and check header and index
+   v->map = (unsigned char*)MapFile(file,&v->len);
+   if (!v->map) Fatal("Cannot open file %s\n",file);
+   v->h = (clip_t*)v->map;
+   v->index = (frame_t*)(v->h+1);
+   if (v->len<sizeof(clip_t) || memcmp(v->h->magic,"CLIP",4) || v->h->version!=CLIP_VERSION)
+      Fatal("%s is not a clip file\n",file);
+   if (v->h->dx<1 || v->h->dx>65536 || v->h->dy<1 || v->h->dy>65536 || v->h->count<1 ||
+       v->len<sizeof(clip_t)+v->h->count*sizeof(frame_t) || v->index[0].codec==FRAME_DELTA)
+      Fatal("Corrupt clip header in %s\n",file);
+   for (k=0;k<v->h->count;k++)
+      if (v->index[k].offset<0 || v->index[k].offset+v->index[k].size>(long long)v->len)
+         Fatal("Corrupt frame %d in %s\n",k,file);
+   v->count = v->h->count;
+   v->fps = fps>0 ? fps : v->h->fps;
+   if (v->fps<=0) Fatal("No frame rate for video %s\n",file);
+   //  Frames are decoded into the same buffers for as long as the video plays
+   n = 3*(size_t)v->h->dx*v->h->dy;
+   v->ref = (unsigned char*)malloc(n);
+   if (!v->ref) Fatal("Cannot allocate memory for video %s\n",file);
+   for (k=0;k<RING;k++)
+   {
+      v->ring[k].image = (unsigned char*)malloc(n);
+      if (!v->ring[k].image) Fatal("Cannot allocate memory for video %s\n",file);
+   }
+   v->have = -1;
+   v->t0 = -1;
+   v->seq = -1;
+   pthread_mutex_init(&v->lock,NULL);
+   pthread_cond_init(&v->full,NULL);
+   pthread_cond_init(&v->ready,NULL);
+
+   //  Texture holds a grey placeholder until the first frame
+   glGenTextures(1,&v->tex);
+   glBindTexture(GL_TEXTURE_2D,v->tex);
+   glTexImage2D(GL_TEXTURE_2D,0,3,1,1,0,GL_RGB,GL_UNSIGNED_BYTE,grey);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+   glGenBuffers(2,v->pbo);
+   ErrCheck("OpenVideo");
+
+   //  Start decoding
+   if (pthread_create(&v->thread,NULL,Decoder,v)) Fatal("Cannot start decoder for video %s\n",file);
+
+   //  Save video
+   video = (video_t**)realloc(video,(Nvideo+1)*sizeof(video_t*));
+   if (!video) Fatal("Cannot allocate memory for video %s\n",file);
+   video[Nvideo] = v;
+   //  Video numbers start at 1
+   return ++Nvideo;
+}
+
+/*
+ *  Stop decoding a video and release it
+ */
+void CloseVideo(int vid)
+{
+   int k;
+   video_t* v;
+   if (vid<1 || vid>Nvideo || !video[vid-1]) return;
+   v = video[vid-1];
+
+   //  Wake the decoder if it is waiting for a slot and let it finish
+   pthread_mutex_lock(&v->lock);
+   v->stop = 1;
+   pthread_cond_signal(&v->full);
+   pthread_mutex_unlock(&v->lock);
+   pthread_join(v->thread,NULL);
+
+   glDeleteBuffers(2,v->pbo);
+   glDeleteTextures(1,&v->tex);
+   pthread_cond_destroy(&v->ready);
+   pthread_cond_destroy(&v->full);
+   pthread_mutex_destroy(&v->lock);
+   for (k=0;k<RING;k++)
+      free(v->ring[k].image);
+   free(v->ref);
+   UnmapFile(v->map,v->len);
+   free(v->file);
+   free(v);
+   video[vid-1] = NULL;
+}
+
+/*
+ *  Texture showing the current frame of a video
+ */
+unsigned int VideoTexture(int vid)
+{
+   if (vid<1 || vid>Nvideo || !video[vid-1]) return 0;
+   return video[vid-1]->tex;
+}
+
+/*
+ *  Copy frame to the video texture through a pixel buffer
+ */
+static void Upload(video_t* v,slot_t* s)
+{
+   unsigned int dx = v->h->dx, dy = v->h->dy;
+   size_t bytes = 3*(size_t)dx*dy;
+   void*  buf;
+
+   //  Copy frame to the pixel buffer
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER,v->pbo[v->ping]);
+   //  Orphan the old storage rather than wait for the GPU to finish with it
+   glBufferData(GL_PIXEL_UNPACK_BUFFER,bytes,NULL,GL_STREAM_DRAW);
+   buf = glMapBuffer(GL_PIXEL_UNPACK_BUFFER,GL_WRITE_ONLY);
+   if (buf)
+   {
+      memcpy(buf,s->image,bytes);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+   }
+   else
+      glBufferData(GL_PIXEL_UNPACK_BUFFER,bytes,s->image,GL_STREAM_DRAW);
+
+   //  Copy pixel buffer to the texture
+   glPushAttrib(GL_TEXTURE_BIT);
+   glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+   glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+   glBindTexture(GL_TEXTURE_2D,v->tex);
+   if (dx!=v->dx || dy!=v->dy)
+   {
+      glTexImage2D(GL_TEXTURE_2D,0,3,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,NULL);
+      v->dx = dx;
+      v->dy = dy;
+   }
+   glTexSubImage2D(GL_TEXTURE_2D,0,0,0,dx,dy,GL_RGB,GL_UNSIGNED_BYTE,NULL);
+   glPopClientAttrib();
+   glPopAttrib();
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
+   v->ping = !v->ping;
+   v->seq = s->seq;
+   ErrCheck("UpdateVideo");
+}
+
+/*
+ *  Show the frame of a video that is due at time t (seconds)
+ *    The clock starts at the first call
+ *    Late frames are dropped and the current frame is repeated until the next is due
+ *    After SyncVideo it waits for the decoder rather than repeat a frame
+ *    Returns the frame number in the texture or -1 before the first frame
+ */
+int UpdateVideo(int vid,double t)
+{
+   video_t*  v;
+   long long due;
+   slot_t*   s=NULL;
+   if (vid<1 || vid>Nvideo || !video[vid-1]) return -1;
+   v = video[vid-1];
+
+   //  Frame due on the media clock
+   if (v->t0<0) v->t0 = t;
+   due = (long long)floor((t-v->t0)*v->fps);
+   if (due<0) due = 0;
+
+   //  Nothing to do while the current frame is still due
+   if (due==v->seq) return v->seq%v->count;
+
+   //  Take the latest decoded frame that is due and drop the ones before it
+   pthread_mutex_lock(&v->lock);
+   v->want = due;
+   while (1)
+   {
+      while (v->n>1 && v->ring[(v->head+1)%RING].seq<=due)
+      {
+         v->head = (v->head+1)%RING;
+         v->n--;
+         pthread_cond_signal(&v->full);
+      }
+      if (v->n && v->ring[v->head].seq<=due)
+         s = v->ring+v->head;
+      //  Wait for the decoder to catch up when every frame must be shown
+      if (!lockstep || (s && s->seq==due)) break;
+      if (s)
+      {
+         v->head = (v->head+1)%RING;
+         v->n--;
+         pthread_cond_signal(&v->full);
+         s = NULL;
+      }
+      pthread_cond_wait(&v->ready,&v->lock);
+   }
+   pthread_mutex_unlock(&v->lock);
+
+   //  Repeat the current frame if the decoder is behind
+   if (s)
+   {
+      Upload(v,s);
+      //  Slot is free again
+      pthread_mutex_lock(&v->lock);
+      v->head = (v->head+1)%RING;
+      v->n--;
+      pthread_cond_signal(&v->full);
+      pthread_mutex_unlock(&v->lock);
+   }
+   return v->seq<0 ? -1 : v->seq%v->count;
+}
+
+/*
+ *  Make UpdateVideo wait for the decoder instead of repeating a frame
+ *    Shows exactly the frame due on the clock, so replays draw the same frames
+ */
+void SyncVideo(int wait)
+{
+   lockstep = wait;
+}